@@ -0,0 +1,140 @@
+// Stress the buffer cache and measure bread() hit latency.
+//
+// A small hot file is read over and over, so every bread()
+// is a cache hit; the time per read is the lookup cost.
+// A file of NBLK blocks is then scanned sequentially by
+// several processes at once.  The cache grows to hold all
+// NCHILD*NBLK blocks, so only the first pass should miss.
+// Finally memory is eaten with sbrk() until it runs out,
+// which should make the cache give its pages back.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "fcntl.h"
+#include "iostat.h"
+
+#define BLK     512
+#define NHOT    8      // blocks in the hot file
+#define NBLK    100    // blocks in each scanned file
+#define NHOTRD  20000  // reads of the hot file
+#define NPASS   20     // scans of each big file
+#define NCHILD  4
+
+char data[BLK];
+
+void
+mkfile(char *path, int nblk)
+{
+  int fd, i;
+
+  fd = open(path, O_CREATE | O_RDWR);
+  if(fd < 0){
+    printf(1, "bcachetest: cannot create %s\n", path);
+    exit();
+  }
+  for(i = 0; i < nblk; i++){
+    memset(data, 'a' + i % 26, sizeof(data));
+    if(write(fd, data, sizeof(data)) != sizeof(data)){
+      printf(1, "bcachetest: write %s failed\n", path);
+      exit();
+    }
+  }
+  close(fd);
+}
+
+// Read path from start to end npass times; return reads done.
+int
+scan(char *path, int npass)
+{
+  int fd, i, n;
+
+  n = 0;
+  for(i = 0; i < npass; i++){
+    if((fd = open(path, O_RDONLY)) < 0){
+      printf(1, "bcachetest: cannot open %s\n", path);
+      exit();
+    }
+    while(read(fd, data, sizeof(data)) == sizeof(data))
+      n++;
+    close(fd);
+  }
+  return n;
+}
+
+void
+report(char *what, int nread, int t0, struct iostat *s0)
+{
+  struct iostat s1;
+  int t;
+
+  t = uptime() - t0;
+  iostat(&s1);
+  printf(1, "%s: %d reads in %d ticks", what, nread, t);
+  if(nread > 0)
+    printf(1, " (%d us/read)", t * 10000 / nread);
+  printf(1, ", %d hits %d misses\n",
+         s1.hits - s0->hits, s1.misses - s0->misses);
+  printf(1, "  cache %d pages (%d grown, %d shrunk), %d pages free\n",
+         s1.npages, s1.grows - s0->grows, s1.shrinks - s0->shrinks,
+         s1.freepages);
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct iostat s0;
+  char path[] = "bcachef0";
+  int i, n, t0;
+
+  iostat(&s0);
+  printf(1, "bcachetest starting, %d buffers in %d pages\n",
+         s0.nbuf, s0.npages);
+
+  mkfile("bcachehot", NHOT);
+  scan("bcachehot", 1);  // warm up
+
+  iostat(&s0);
+  t0 = uptime();
+  n = 0;
+  while(n < NHOTRD)
+    n += scan("bcachehot", 1);
+  report("hot", n, t0, &s0);
+  unlink("bcachehot");
+
+  for(i = 0; i < NCHILD; i++){
+    path[7] = '0' + i;
+    mkfile(path, NBLK);
+  }
+
+  iostat(&s0);
+  t0 = uptime();
+  for(i = 0; i < NCHILD; i++){
+    if(fork() == 0){
+      path[7] = '0' + i;
+      scan(path, NPASS);
+      exit();
+    }
+  }
+  for(i = 0; i < NCHILD; i++)
+    wait();
+  report("scan", NCHILD * NPASS * NBLK, t0, &s0);
+
+  for(i = 0; i < NCHILD; i++){
+    path[7] = '0' + i;
+    unlink(path);
+  }
+
+  // Use up memory; the cache should shrink to make room.
+  iostat(&s0);
+  t0 = uptime();
+  n = 0;
+  while(sbrk(64*4096) != (char*)-1)
+    n += 64;
+  report("pressure", 0, t0, &s0);
+  printf(1, "  sbrk got %d pages\n", n);
+  sbrk(-n*4096);
+
+  printf(1, "bcachetest ok\n");
+  exit();
+}
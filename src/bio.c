@@ -7,7 +7,7 @@
 // 
 // Interface:
 // * To get a buffer for a particular disk block, call bread.
-// * After changing buffer data, call bwrite to write it to disk.
+// * After changing buffer data, call bwrite to have it written to disk.
 // * When done with the buffer, call brelse.
 // * Do not use the buffer after calling brelse.
 // * Only one process at a time can use a buffer,
@@ -19,82 +19,475 @@
 // * B_VALID: the buffer data has been read from the disk.
 // * B_DIRTY: the buffer data has been modified
 //     and needs to be written to disk.
+// * B_DELWRI: bwrite() has been called but the data
+//     is not on disk yet.
+//
+// Buffers are found through a hash table keyed on
+// (dev, blockno) with one lock per bucket, so a cache hit
+// costs a short chain walk instead of a scan of every buffer.
+// Eviction still picks the least recently used clean buffer.
+//
+// A buffer only holds as many bytes as its device's block
+// size, and the cache grows and shrinks with free memory;
+// see bdata_alloc() and bshrink().
+//
+// Writes are delayed: bwrite() marks the buffer B_DELWRI and
+// returns, and a writeback thread per device writes buffers
+// out once they are WBTICKS old, a batch at a time in block
+// order.  bflush() writes a device's buffers out now.  Until
+// then the buffer cannot be evicted.
 
 #include "types.h"
 #include "defs.h"
 #include "param.h"
+#include "mmu.h"
 #include "spinlock.h"
+#include "list.h"
 #include "vfs.h"
 #include "file.h"
 #include "buf.h"
+#include "iostat.h"
+
+// Buffer data lives in chunks carved out of kalloc() pages.
+// Every page is cut into chunks of one block size only (a size
+// class), so a 512-byte s5 block uses 512 bytes and a 4096-byte
+// ext2 block a whole page.
+//
+// The cache grows by a page on a miss as long as more than
+// PGHIWAT pages of memory are free; otherwise it recycles its
+// least recently used buffer.  When kalloc() sees free memory
+// drop below PGLOWAT it calls bshrink(), which gives back the
+// data of clean, unused buffers until PGHIWAT pages are free
+// again or the cache is down to NBUF pages.  Buffer headers
+// and page descriptors are carved from kalloc() pages too and
+// are never given back; they are small.
+#define NCLASS      4   // MINBSIZE, 2*MINBSIZE, ..., MAXBSIZE
+
+struct bpage {
+  char *va;               // The page, 0 if this descriptor is unused
+  uint size;              // Chunk size this page is cut into
+  uint nfree;             // Number of free chunks in the page
+  char *freelist;         // Free chunks, linked through their first word
+  struct list_head list;  // On class[] while it has free chunks,
+                          // on freepages while va is 0
+};
+
+// Hash bucket.  Holds the buffers whose (dev, blockno)
+// hashes to it, linked through hprev/hnext.
+struct bucket {
+  struct spinlock lock;
+  struct buf head;
+  uint hits;
+  uint rahits;
+};
 
 struct {
   struct spinlock lock;
-  struct buf buf[NBUF];
 
   // Linked list of all buffers, through prev/next.
-  // head.next is most recently used.
+  // head.next is most recently used.  Buffers without
+  // data are kept towards the tail.
   struct buf head;
+
+  struct bucket bucket[NBUCKET];
+  uint misses;
+
+  // Pages holding buffer data.  Protected by lock.
+  struct list_head class[NCLASS];
+  struct list_head freepages;
+  uint npages;
+  uint nbuf;
+  uint grows;
+  uint shrinks;
+  uint raissued;
+  uint wbwrites;
 } bcache;
 
+#define WBBATCH     64  // Blocks written behind at a time
+
+// Write-behind state of a device.  Protected by bcache.lock.
+struct wbdev {
+  struct proc *proc;  // Writeback thread, 0 if not started
+  uint dev;
+  uint ndelwri;       // B_DELWRI buffers
+  uint since;         // ticks when the oldest was written
+  uint nwriting;      // taken by bdelwri(), write not done yet
+} wbdev[NDEV];
+
+static struct bucket*
+bhash(uint dev, uint blockno)
+{
+  return &bcache.bucket[(dev * 1021 + blockno) % NBUCKET];
+}
+
+// Insert b at the head of bucket bk.
+// Caller must hold bk->lock.
+static void
+bucket_insert(struct bucket *bk, struct buf *b)
+{
+  b->hnext = bk->head.hnext;
+  b->hprev = &bk->head;
+  bk->head.hnext->hprev = b;
+  bk->head.hnext = b;
+}
+
+// Remove b from the bucket it is on.  A buffer without
+// data is on no bucket and points at itself.
+// Caller must hold that bucket's lock.
+static void
+bucket_remove(struct buf *b)
+{
+  b->hnext->hprev = b->hprev;
+  b->hprev->hnext = b->hnext;
+  b->hnext = b->hprev = b;
+}
+
+// Look for block blockno of dev in bucket bk.
+// Caller must hold bk->lock.
+static struct buf*
+bucket_lookup(struct bucket *bk, uint dev, uint blockno)
+{
+  struct buf *b;
+
+  for(b = bk->head.hnext; b != &bk->head; b = b->hnext)
+    if(b->dev == dev && b->blockno == blockno)
+      return b;
+  return 0;
+}
+
+// Move b to the LRU tail, where it is reused first.
+// Caller must hold bcache.lock.
+static void
+bmovetail(struct buf *b)
+{
+  b->next->prev = b->prev;
+  b->prev->next = b->next;
+  b->prev = bcache.head.prev;
+  b->next = &bcache.head;
+  bcache.head.prev->next = b;
+  bcache.head.prev = b;
+}
+
+// Add a page worth of empty buffer headers at the LRU tail.
+// Caller must hold bcache.lock.
+static int
+bhdr_grow(void)
+{
+  struct buf *b;
+  char *p;
+
+  if((p = kalloc()) == 0)
+    return 0;
+  memset(p, 0, PGSIZE);
+  for(b = (struct buf*)p; b + 1 <= (struct buf*)(p + PGSIZE); b++){
+    b->dev = -1;
+    b->hnext = b->hprev = b;
+    b->next = b->prev = b;
+    bmovetail(b);
+  }
+  return 1;
+}
+
+// Add a page worth of unused page descriptors.
+// Caller must hold bcache.lock.
+static int
+bpage_grow(void)
+{
+  struct bpage *pg;
+  char *p;
+
+  if((p = kalloc()) == 0)
+    return 0;
+  memset(p, 0, PGSIZE);
+  for(pg = (struct bpage*)p; pg + 1 <= (struct bpage*)(p + PGSIZE); pg++)
+    list_add_tail(&pg->list, &bcache.freepages);
+  return 1;
+}
+
+static int
+sizeclass(uint size)
+{
+  int c;
+
+  for(c = 0; c < NCLASS; c++)
+    if((MINBSIZE << c) == size)
+      return c;
+  panic("bio: bad block size");
+}
+
+// Give b a chunk of size bytes for its data.  If no chunk
+// of that size is free and grow is set, take a new page
+// from kalloc().  Returns 0 if there is no chunk.
+// Caller must hold bcache.lock.
+static int
+bdata_alloc(struct buf *b, uint size, int grow)
+{
+  struct list_head *cl;
+  struct bpage *pg;
+  char *p;
+
+  cl = &bcache.class[sizeclass(size)];
+  if(list_empty(cl)){
+    if(!grow)
+      return 0;
+    if(list_empty(&bcache.freepages) && !bpage_grow())
+      return 0;
+    if((p = kalloc()) == 0)
+      return 0;
+    pg = list_first_entry(&bcache.freepages, struct bpage, list);
+    list_move(&pg->list, cl);
+    pg->va = p;
+    pg->size = size;
+    pg->nfree = 0;
+    pg->freelist = 0;
+    for(; p < pg->va + PGSIZE; p += size){
+      *(char**)p = pg->freelist;
+      pg->freelist = p;
+      pg->nfree++;
+    }
+    bcache.npages++;
+    bcache.grows++;
+  }
+  pg = list_first_entry(cl, struct bpage, list);
+  b->data = (uchar*)pg->freelist;
+  pg->freelist = *(char**)pg->freelist;
+  if(--pg->nfree == 0)
+    list_del_init(&pg->list);
+  b->page = pg;
+  b->bsize = size;
+  bcache.nbuf++;
+  return 1;
+}
+
+// Return b's data chunk to its page, and the page
+// to kalloc() once all its chunks are free.
+// Caller must hold bcache.lock.
+static void
+bdata_free(struct buf *b)
+{
+  struct bpage *pg;
+
+  pg = b->page;
+  *(char**)b->data = pg->freelist;
+  pg->freelist = (char*)b->data;
+  if(pg->nfree++ == 0)
+    list_add(&pg->list, &bcache.class[sizeclass(pg->size)]);
+  if(pg->nfree == PGSIZE / pg->size){
+    kfree(pg->va);
+    pg->va = 0;
+    list_move(&pg->list, &bcache.freepages);
+    bcache.npages--;
+  }
+  b->data = 0;
+  b->page = 0;
+  bcache.nbuf--;
+}
+
+// Take b, a buffer nobody is using, off its hash bucket.
+// Returns 0 if b is busy or dirty or waits to be written.  The caller holds
+// bcache.lock and, if bk is not 0, bk->lock.
+static int
+bunhash(struct buf *b, struct bucket *bk)
+{
+  struct bucket *obk;
+
+  obk = bhash(b->dev, b->blockno);
+  if(obk != bk)
+    acquire(&obk->lock);
+  if(b->flags & (B_BUSY|B_DIRTY|B_DELWRI)){
+    if(obk != bk)
+      release(&obk->lock);
+    return 0;
+  }
+  bucket_remove(b);
+  if(obk != bk)
+    release(&obk->lock);
+  b->dev = -1;
+  return 1;
+}
+
 void
 binit(void)
 {
-  struct buf *b;
+  struct bucket *bk;
+  int c;
 
   initlock(&bcache.lock, "bcache");
 
-//PAGEBREAK!
-  // Create linked list of buffers
+  for(bk = bcache.bucket; bk < bcache.bucket+NBUCKET; bk++){
+    initlock(&bk->lock, "bcache.bucket");
+    bk->head.hprev = &bk->head;
+    bk->head.hnext = &bk->head;
+  }
+
+  for(c = 0; c < NCLASS; c++)
+    INIT_LIST_HEAD(&bcache.class[c]);
+  INIT_LIST_HEAD(&bcache.freepages);
+
+  // Buffers are created on demand by bget().
   bcache.head.prev = &bcache.head;
   bcache.head.next = &bcache.head;
-  for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    b->dev = -1;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
-  }
+}
+
+// Print how dev's blocks are cached.
+void
+bcacheinfo(uint dev)
+{
+  cprintf("bcache: dev %d: %d-byte blocks, %d per page; "
+          "%d pages cached, grows while %d of %d pages free\n",
+          dev, sb[dev].blocksize, PGSIZE / sb[dev].blocksize,
+          bcache.npages, PGHIWAT, kfreepages());
 }
 
 // Look through buffer cache for block on device dev.
 // If not found, allocate a buffer.
 // In either case, return B_BUSY buffer.
+//
+// A lookup only takes the lock of the bucket the block
+// hashes to.  Recycling a buffer takes bcache.lock, which
+// protects the LRU list, the data pages and serializes
+// evictions, and then the locks of the old and new buckets.
+// Nobody else holds two bucket locks, or a bucket lock while
+// acquiring bcache.lock, so the lock order is deadlock free.
 static struct buf*
 bget(uint dev, uint blockno)
 {
-  struct buf *b;
+  struct buf *b, *prev, *victim;
+  struct bucket *bk;
+  uint size, npages;
+  int grow;
 
-  acquire(&bcache.lock);
+  size = sb[dev].blocksize;
+  bk = bhash(dev, blockno);
+  acquire(&bk->lock);
 
  loop:
   // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
-    if(b->dev == dev && b->blockno == blockno){
-      if(!(b->flags & B_BUSY)){
-        b->flags |= B_BUSY;
-        release(&bcache.lock);
-        return b;
+  if((b = bucket_lookup(bk, dev, blockno)) != 0 && b->bsize == size){
+    if(!(b->flags & B_BUSY)){
+      b->flags |= B_BUSY;
+      bk->hits++;
+      if(b->flags & B_RA){
+        b->flags &= ~B_RA;
+        bk->rahits++;
       }
-      sleep(b, &bcache.lock);
+      release(&bk->lock);
+      return b;
+    }
+    sleep(b, &bk->lock);
+    goto loop;
+  }
+  release(&bk->lock);
+
+  acquire(&bcache.lock);
+  acquire(&bk->lock);
+  if((b = bucket_lookup(bk, dev, blockno)) != 0){
+    if(b->bsize == size || (b->flags & B_BUSY)){
+      // Someone else cached it while we were unlocked,
+      // or is still using it at the old block size.
+      release(&bcache.lock);
+      if(b->bsize == size)
+        goto loop;
+      sleep(b, &bk->lock);
       goto loop;
     }
+    // Cached at a block size the device no longer uses
+    // (ext2_readsb() re-reads the superblock this way).
+    if(b->flags & (B_DIRTY|B_DELWRI))
+      panic("bget: block size changed");
+    bucket_remove(b);
+    bdata_free(b);
+    b->dev = -1;
+    bmovetail(b);
+  }
+
+  // Not cached.  While memory is plentiful, use an empty
+  // buffer and a new chunk of data.
+  grow = kfreepages() > PGHIWAT;
+  victim = 0;
+  b = bcache.head.prev;
+  if((b == &bcache.head || b->data) && grow && bhdr_grow())
+    b = bcache.head.prev;
+  if(b != &bcache.head && b->data == 0){
+    victim = b;
+    if(bdata_alloc(victim, size, grow))
+      goto found;
   }
 
-  // Not cached; recycle some non-busy and clean buffer.
+  // Otherwise recycle some non-busy and clean buffer.
   // "clean" because B_DIRTY and !B_BUSY means log.c
   // hasn't yet committed the changes to the buffer.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if((b->flags & B_BUSY) == 0 && (b->flags & B_DIRTY) == 0){
-      b->dev = dev;
-      b->blockno = blockno;
-      b->flags = B_BUSY;
-      b->bsize = sb[dev].blocksize;
-      release(&bcache.lock);
-      return b;
+  // If the block size differs from the victim's, keep
+  // evicting until a chunk of the right size is free,
+  // taking a new page only in place of one given back.
+  npages = bcache.npages;
+  for(b = bcache.head.prev; b != &bcache.head; b = prev){
+    prev = b->prev;
+    if(b->data == 0){
+      if(victim == 0)
+        victim = b;
+      continue;
+    }
+    if(!bunhash(b, bk))
+      continue;
+    if(victim == 0 && b->bsize == size){
+      victim = b;
+      goto found;
     }
+    bdata_free(b);
+    if(victim == 0)
+      victim = b;
+    else
+      bmovetail(b);
+    if(bdata_alloc(victim, size, grow || bcache.npages < npages))
+      goto found;
   }
   panic("bget: no buffers");
+
+ found:
+  b = victim;
+  b->dev = dev;
+  b->blockno = blockno;
+  b->flags = B_BUSY;
+  b->unpin = 0;
+  bucket_insert(bk, b);
+  bcache.misses++;
+  release(&bk->lock);
+  release(&bcache.lock);
+  return b;
+}
+
+// Called by kalloc() when free memory runs low.  Give back
+// the data of clean buffers nobody is using, least recently
+// used first, until PGHIWAT pages are free or the cache is
+// down to NBUF pages.
+void
+bshrink(void)
+{
+  struct buf *b, *prev;
+  uint npages;
+  int held;
+
+  // bget() itself allocates with bcache.lock held.
+  pushcli();
+  held = holding(&bcache.lock);
+  popcli();
+  if(held || bcache.npages <= NBUF)
+    return;
+
+  acquire(&bcache.lock);
+  for(b = bcache.head.prev; b != &bcache.head; b = prev){
+    prev = b->prev;
+    if(bcache.npages <= NBUF || kfreepages() >= PGHIWAT)
+      break;
+    if(b->data == 0 || !bunhash(b, 0))
+      continue;
+    npages = bcache.npages;
+    bdata_free(b);
+    bcache.shrinks += npages - bcache.npages;
+    bmovetail(b);
+  }
+  release(&bcache.lock);
 }
 
 // Return a B_BUSY buf with the contents of the indicated block.
@@ -110,14 +503,71 @@ bread(uint dev, uint blockno)
   return b;
 }
 
-// Write b's contents to disk.  Must be B_BUSY.
+// Start reading block blockno of dev into the cache, unless
+// it is there already, and return without waiting for the disk.
+void
+breada(uint dev, uint blockno)
+{
+  struct bucket *bk;
+  struct buf *b;
+
+  bk = bhash(dev, blockno);
+  acquire(&bk->lock);
+  b = bucket_lookup(bk, dev, blockno);
+  release(&bk->lock);
+  if(b)
+    return;
+
+  b = bget(dev, blockno);
+  if(b->flags & B_VALID){
+    brelse(b);
+    return;
+  }
+  b->flags |= B_RA;
+  acquire(&bcache.lock);
+  bcache.raissued++;
+  release(&bcache.lock);
+  b->iodone = brelse;
+  idesubmit(b);
+}
+
+// Have b's contents written to disk.  Must be B_BUSY.
+// Only waits for the disk if dev has no writeback thread.
 void
 bwrite(struct buf *b)
 {
+  struct wbdev *w;
+
   if((b->flags & B_BUSY) == 0)
     panic("bwrite");
-  b->flags |= B_DIRTY;
-  iderw(b);
+  w = &wbdev[b->dev];
+  if(w->proc == 0){
+    b->flags |= B_DIRTY;
+    iderw(b);
+    return;
+  }
+  acquire(&bcache.lock);
+  if(!(b->flags & B_DELWRI)){
+    b->flags |= B_DELWRI;
+    b->dtime = ticks;
+    if(w->ndelwri++ == 0)
+      w->since = ticks;
+  }
+  release(&bcache.lock);
+}
+
+// Write n B_BUSY buffers to disk, all queued at once.
+void
+bwritev(struct buf **bv, int n)
+{
+  int i;
+
+  for(i = 0; i < n; i++){
+    if((bv[i]->flags & B_BUSY) == 0)
+      panic("bwrite");
+    bv[i]->flags |= B_DIRTY;
+  }
+  iderwv(bv, n);
 }
 
 // Release a B_BUSY buffer.
@@ -125,21 +575,266 @@ bwrite(struct buf *b)
 void
 brelse(struct buf *b)
 {
+  struct bucket *bk;
+
   if((b->flags & B_BUSY) == 0)
     panic("brelse");
 
-  acquire(&bcache.lock);
+  // b->dev and b->blockno cannot change while we hold
+  // the buffer, so the bucket is stable.
+  bk = bhash(b->dev, b->blockno);
 
+  acquire(&bcache.lock);
   b->next->prev = b->prev;
   b->prev->next = b->next;
   b->next = bcache.head.next;
   b->prev = &bcache.head;
   bcache.head.next->prev = b;
   bcache.head.next = b;
+  release(&bcache.lock);
 
+  acquire(&bk->lock);
+  if(b->unpin){
+    b->flags &= ~B_DIRTY;
+    b->unpin = 0;
+  }
   b->flags &= ~B_BUSY;
   wakeup(b);
+  release(&bk->lock);
+}
+
+// Let the cache evict b, a block the log had pinned with
+// B_DIRTY, now that its home copy is up to date.  If somebody
+// is using b, only note it; brelse() unpins b then, unless
+// log_write() has pinned it again meanwhile.  Called with
+// the log's lock held, which keeps log_write() out.
+void
+bunpin(struct buf *b)
+{
+  struct bucket *bk;
+
+  bk = bhash(b->dev, b->blockno);
+  acquire(&bk->lock);
+  if(b->flags & B_BUSY)
+    b->unpin = 1;
+  else
+    b->flags &= ~B_DIRTY;
+  release(&bk->lock);
+}
+
+// Drop dev's cached blocks that nobody is using, so the next
+// bread() of them goes to the disk.  For after writes that
+// did not go through the cache.
+void
+binval(uint dev)
+{
+  struct buf *b, *prev;
+
+  acquire(&bcache.lock);
+  for(b = bcache.head.prev; b != &bcache.head; b = prev){
+    prev = b->prev;
+    if(b->data == 0 || b->dev != dev || !bunhash(b, 0))
+      continue;
+    bdata_free(b);
+    bmovetail(b);
+  }
+  release(&bcache.lock);
+}
+
+// Take up to WBBATCH of dev's B_DELWRI buffers that nobody is
+// using, only those at least WBTICKS old unless all is set,
+// and put them in bv sorted by block number.  Returns how
+// many it took.  They are B_BUSY and no longer B_DELWRI.
+static int
+bdelwri(struct wbdev *w, int all, struct buf **bv)
+{
+  struct buf *b;
+  struct bucket *bk;
+  int i, n;
+  uint oldest;
+
+  n = 0;
+  oldest = ticks;
+  acquire(&bcache.lock);
+  for(b = bcache.head.next; b != &bcache.head; b = b->next){
+    if(b->dev != w->dev || !(b->flags & B_DELWRI))
+      continue;
+    if(n == WBBATCH || (!all && ticks - b->dtime < WBTICKS) ||
+       (b->flags & B_DIRTY)){
+      if(b->dtime < oldest)
+        oldest = b->dtime;
+      continue;
+    }
+    bk = bhash(b->dev, b->blockno);
+    acquire(&bk->lock);
+    if(b->flags & B_BUSY){
+      release(&bk->lock);
+      if(b->dtime < oldest)
+        oldest = b->dtime;
+      continue;
+    }
+    b->flags = (b->flags | B_BUSY) & ~B_DELWRI;
+    release(&bk->lock);
+    // insertion sort by block number
+    for(i = n++; i > 0 && bv[i-1]->blockno > b->blockno; i--)
+      bv[i] = bv[i-1];
+    bv[i] = b;
+  }
+  w->ndelwri -= n;
+  w->nwriting += n;
+  w->since = oldest;
+  bcache.wbwrites += n;
+  release(&bcache.lock);
+  return n;
+}
+
+// Write bv[0..n-1], B_BUSY buffers from bdelwri(), and give
+// them back without touching their place in the LRU list.
+static void
+bwriteback(struct buf **bv, int n)
+{
+  struct wbdev *w = &wbdev[bv[0]->dev];
+  struct bucket *bk;
+  int i;
+
+  bwritev(bv, n);
+  for(i = 0; i < n; i++){
+    bk = bhash(bv[i]->dev, bv[i]->blockno);
+    acquire(&bk->lock);
+    bv[i]->flags &= ~B_BUSY;
+    wakeup(bv[i]);
+    release(&bk->lock);
+  }
+  acquire(&bcache.lock);
+  w->nwriting -= n;
+  if(w->nwriting == 0)
+    wakeup(&w->nwriting);
+  release(&bcache.lock);
+}
+
+// Wait for the holder of one of w's B_DELWRI buffers, delayed
+// no later than tick start, to give it back; bdelwri() can
+// take it then.  Returns 0 if nobody holds such a buffer.
+static int
+bwaitheld(struct wbdev *w, uint start)
+{
+  struct buf *b;
+  struct bucket *bk;
+
+  acquire(&bcache.lock);
+  for(b = bcache.head.next; b != &bcache.head; b = b->next){
+    if(b->dev != w->dev || (b->flags & (B_DELWRI|B_DIRTY)) != B_DELWRI ||
+       (int)(b->dtime - start) > 0)
+      continue;
+    bk = bhash(b->dev, b->blockno);
+    acquire(&bk->lock);
+    release(&bcache.lock);
+    if(b->flags & B_BUSY)
+      sleep(b, &bk->lock);
+    release(&bk->lock);
+    return 1;
+  }
+  release(&bcache.lock);
+  return 0;
+}
+
+// Write out every buffer of dev that bwrite() has delayed,
+// and wait for writes the writeback thread has under way.
+// Buffers somebody holds are written once brelse() gives
+// them back, so the caller must not hold any.
+void
+bflush(uint dev)
+{
+  struct buf *bv[WBBATCH];
+  struct wbdev *w;
+  uint start;
+  int n;
 
+  if(dev >= NDEV || wbdev[dev].proc == 0)
+    return;
+  w = &wbdev[dev];
+  start = ticks;
+  do {
+    while((n = bdelwri(w, 1, bv)) > 0)
+      bwriteback(bv, n);
+  } while(bwaitheld(w, start));
+
+  acquire(&bcache.lock);
+  while(w->nwriting > 0)
+    sleep(&w->nwriting, &bcache.lock);
+  release(&bcache.lock);
+}
+
+// The writeback thread of a device.  Sleeps until its
+// oldest delayed write is WBTICKS old.
+static void
+bwbthread(void *arg)
+{
+  struct wbdev *w = arg;
+  struct buf *bv[WBBATCH];
+  int n;
+
+  for(;;){
+    acquire(&bcache.lock);
+    while(w->ndelwri == 0 || ticks - w->since < WBTICKS)
+      sleep(w, &bcache.lock);
+    release(&bcache.lock);
+    while((n = bdelwri(w, 0, bv)) > 0)
+      bwriteback(bv, n);
+  }
+}
+
+// Start dev's writeback thread.  Until then bwrite() on dev
+// writes through.
+void
+bwbinit(uint dev)
+{
+  struct wbdev *w = &wbdev[dev];
+
+  if(w->proc != 0)
+    return;
+  w->dev = dev;
+  if((w->proc = kthread("writeback", bwbthread, w)) == 0)
+    panic("bwbinit");
+}
+
+// Called on every clock tick: wake the writeback threads
+// with delayed writes old enough to go to disk.
+void
+bwbtimer(void)
+{
+  struct wbdev *w;
+
+  for(w = wbdev; w < &wbdev[NDEV]; w++)
+    if(w->proc != 0 && w->ndelwri > 0 && ticks - w->since >= WBTICKS)
+      wakeup(w);
+}
+
+// Copy buffer cache statistics to st.
+void
+bstat(struct iostat *st)
+{
+  struct bucket *bk;
+  int i;
+
+  st->hits = 0;
+  st->rahits = 0;
+  for(bk = bcache.bucket; bk < bcache.bucket+NBUCKET; bk++){
+    st->hits += bk->hits;
+    st->rahits += bk->rahits;
+  }
+  acquire(&bcache.lock);
+  st->nbuf = bcache.nbuf;
+  st->npages = bcache.npages;
+  st->misses = bcache.misses;
+  st->grows = bcache.grows;
+  st->shrinks = bcache.shrinks;
+  st->freepages = kfreepages();
+  st->raissued = bcache.raissued;
+  st->wbwrites = bcache.wbwrites;
+  st->delwri = 0;
+  for(i = 0; i < NDEV; i++)
+    st->delwri += wbdev[i].ndelwri;
   release(&bcache.lock);
 }
 //PAGEBREAK!
@@ -0,0 +1,147 @@
+// Time bitmap searches on full 4 KB bitmap blocks.
+//
+// usage: bitbench [iters]
+//
+// Scans a 32768-bit bitmap the way the block allocators do:
+// for the first free bit, for a run of free bits, and to
+// count the free bits.  Each search runs iters (default 500)
+// times bit by bit and again through find_bits.c, on a full
+// bitmap with only the last bit free and on one with every
+// 64th bit free.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "find_bits.h"
+
+#define NBITS (4096 * 8)
+#define RUN 8
+
+unsigned long map[NBITS / (8 * sizeof(unsigned long))];
+
+int
+isset(int b)
+{
+  return ((uchar *)map)[b / 8] & (1 << (b % 8));
+}
+
+int
+naive_zero(int off)
+{
+  int b;
+
+  for(b = off; b < NBITS; b++)
+    if(!isset(b))
+      return b;
+  return NBITS;
+}
+
+int
+naive_run(int len)
+{
+  int b, n;
+
+  n = 0;
+  for(b = 0; b < NBITS; b++){
+    if(isset(b)){
+      n = 0;
+      continue;
+    }
+    if(++n == len)
+      return b - len + 1;
+  }
+  return NBITS;
+}
+
+int
+naive_weight(void)
+{
+  int b, n;
+
+  n = 0;
+  for(b = 0; b < NBITS; b++)
+    if(isset(b))
+      n++;
+  return n;
+}
+
+void
+fill(int stride)
+{
+  int b;
+
+  memset(map, 0xff, sizeof(map));
+  for(b = stride - 1; b < NBITS; b += stride)
+    ((uchar *)map)[b / 8] &= ~(1 << (b % 8));
+}
+
+void
+report(char *what, int iters, int t0, int t1)
+{
+  printf(1, "  %s: bitwise %d ticks, by word %d ticks", what, t0, t1);
+  if(t1 > 0)
+    printf(1, " (%dx)", t0 / t1);
+  printf(1, " for %d scans\n", iters);
+}
+
+void
+check(char *what, int a, int b)
+{
+  if(a != b){
+    printf(2, "bitbench: %s: bitwise %d, by word %d\n", what, a, b);
+    exit();
+  }
+}
+
+void
+bench(char *name, int stride, int iters)
+{
+  int i, t, t0, r0, r1;
+
+  fill(stride);
+  printf(1, "%s:\n", name);
+
+  r0 = r1 = 0;
+  t = uptime();
+  for(i = 0; i < iters; i++)
+    r0 = naive_zero(0);
+  t0 = uptime() - t;
+  t = uptime();
+  for(i = 0; i < iters; i++)
+    r1 = find_next_zero_bit(map, NBITS, 0);
+  report("next zero", iters, t0, uptime() - t);
+  check("next zero", r0, r1);
+
+  t = uptime();
+  for(i = 0; i < iters; i++)
+    r0 = naive_run(RUN);
+  t0 = uptime() - t;
+  t = uptime();
+  for(i = 0; i < iters; i++)
+    r1 = find_zero_run(map, NBITS, 0, RUN);
+  report("zero run", iters, t0, uptime() - t);
+  check("zero run", r0, r1);
+
+  t = uptime();
+  for(i = 0; i < iters; i++)
+    r0 = naive_weight();
+  t0 = uptime() - t;
+  t = uptime();
+  for(i = 0; i < iters; i++)
+    r1 = bitmap_weight(map, NBITS);
+  report("weight", iters, t0, uptime() - t);
+  check("weight", r0, r1);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int iters;
+
+  iters = 500;
+  if(argc > 1)
+    iters = atoi(argv[1]);
+  bench("last bit free", NBITS, iters);
+  bench("every 64th bit free", 64, iters);
+  exit();
+}
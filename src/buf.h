@@ -3,6 +3,8 @@
 #ifndef XV6_BUF_H_
 #define XV6_BUF_H_
 
+struct bpage;
+
 struct buf {
   int flags;
   uint dev;
@@ -10,12 +12,20 @@ struct buf {
   uint bsize;       // Block Size of this buffer
   struct buf *prev; // LRU cache list
   struct buf *next;
+  struct buf *hprev; // hash bucket list
+  struct buf *hnext;
   struct buf *qnext; // disk queue
-  uchar data[MAXBSIZE];
+  void (*iodone)(struct buf*); // called when an idesubmit() is done
+  struct bpage *page; // page data was carved from
+  uchar *data;      // bsize bytes, 0 if none
+  uint dtime;       // ticks when B_DELWRI was set
+  int unpin;        // bunpin() came while B_BUSY; brelse() does it
 };
 #define B_BUSY  0x1  // buffer is locked by some process
 #define B_VALID 0x2  // buffer has been read from disk
 #define B_DIRTY 0x4  // buffer needs to be written to disk
+#define B_RA    0x8  // read ahead and not yet asked for
+#define B_DELWRI 0x10 // written by bwrite(), not yet on disk
 
 #endif /* XV6_BUF_H_ */
 
@@ -0,0 +1,195 @@
+// Directory entry cache.
+//
+// Remembers what dirlookup() found: which inode a name in a
+// directory refers to, or that the name is not there (a
+// negative entry), so that namex() can resolve a path it has
+// seen before without reading any directory blocks.
+//
+// Entries are keyed on the directory's (dev, inum) and the
+// name, and recycled least recently used first.  Changes to a
+// directory must go through denter(), with the directory
+// locked: sys_link(), create() and sys_unlink() do so.  When a
+// directory inode is freed its entries go with it, and a
+// mount drops every entry of the mounted device.
+//
+// A positive entry only records the child's inode number;
+// namex() still needs the inode itself to be in the inode
+// cache (see icached()), otherwise it falls back to
+// dirlookup().
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "spinlock.h"
+#include "vfs.h"
+#include "iostat.h"
+
+#define NDENTRY 512   // cached directory entries
+#define NDHASH  257   // hash buckets
+
+struct dentry {
+  uint dev;             // Directory's device
+  uint dinum;           // Directory's inode number, 0 if unused
+  char name[DIRSIZ];
+  uint inum;            // Inode name refers to, 0 if none
+  struct dentry *hnext; // hash chain
+  struct dentry *prev;  // LRU list
+  struct dentry *next;
+};
+
+struct {
+  struct spinlock lock;
+  struct dentry dentry[NDENTRY];
+  struct dentry *hash[NDHASH];
+  struct dentry head;   // head.next is most recently used
+  uint hits;
+  uint neghits;
+  uint misses;
+} dcache;
+
+void
+dinit(void)
+{
+  struct dentry *d;
+
+  initlock(&dcache.lock, "dcache");
+  dcache.head.prev = &dcache.head;
+  dcache.head.next = &dcache.head;
+  for(d = dcache.dentry; d < dcache.dentry+NDENTRY; d++){
+    d->next = dcache.head.next;
+    d->prev = &dcache.head;
+    dcache.head.next->prev = d;
+    dcache.head.next = d;
+  }
+}
+
+static struct dentry**
+dhash(uint dev, uint dinum, char *name)
+{
+  uint h;
+  int i;
+
+  h = dev * 31 + dinum;
+  for(i = 0; i < DIRSIZ && name[i]; i++)
+    h = h * 31 + (uchar)name[i];
+  return &dcache.hash[h % NDHASH];
+}
+
+// Move d to the front of the LRU list.
+static void
+dtouch(struct dentry *d)
+{
+  d->prev->next = d->next;
+  d->next->prev = d->prev;
+  d->next = dcache.head.next;
+  d->prev = &dcache.head;
+  dcache.head.next->prev = d;
+  dcache.head.next = d;
+}
+
+// Take d off its hash chain and make it unused.
+static void
+dunhash(struct dentry *d)
+{
+  struct dentry **pp;
+
+  for(pp = dhash(d->dev, d->dinum, d->name); *pp != d; pp = &(*pp)->hnext)
+    ;
+  *pp = d->hnext;
+  d->dinum = 0;
+}
+
+// Find the entry for name in dp.  Caller holds dcache.lock.
+static struct dentry*
+dfind(struct inode *dp, char *name)
+{
+  struct dentry *d;
+
+  for(d = *dhash(dp->dev, dp->inum, name); d != 0; d = d->hnext)
+    if(d->dev == dp->dev && d->dinum == dp->inum &&
+       strncmp(d->name, name, DIRSIZ) == 0)
+      return d;
+  return 0;
+}
+
+// Look name up in directory dp, which the caller has locked.
+// Returns 1 and sets *inum (0 if name is known not to be in
+// dp) if the answer is cached, 0 if it is not.
+int
+dlookup(struct inode *dp, char *name, uint *inum)
+{
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  if((d = dfind(dp, name)) == 0){
+    dcache.misses++;
+    release(&dcache.lock);
+    return 0;
+  }
+  *inum = d->inum;
+  if(d->inum)
+    dcache.hits++;
+  else
+    dcache.neghits++;
+  dtouch(d);
+  release(&dcache.lock);
+  return 1;
+}
+
+// Record that name in directory dp, which the caller has
+// locked, refers to inode inum, or to nothing if inum is 0.
+void
+denter(struct inode *dp, char *name, uint inum)
+{
+  struct dentry *d, **h;
+
+  acquire(&dcache.lock);
+  if((d = dfind(dp, name)) == 0){
+    d = dcache.head.prev;
+    if(d->dinum)
+      dunhash(d);
+    d->dev = dp->dev;
+    d->dinum = dp->inum;
+    strncpy(d->name, name, DIRSIZ);
+    h = dhash(d->dev, d->dinum, d->name);
+    d->hnext = *h;
+    *h = d;
+  }
+  d->inum = inum;
+  dtouch(d);
+  release(&dcache.lock);
+}
+
+// Forget the entries of directory dinum on dev, or of every
+// directory on dev if dinum is 0.
+void
+dpurge(uint dev, uint dinum)
+{
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  for(d = dcache.dentry; d < dcache.dentry+NDENTRY; d++){
+    if(d->dinum == 0 || d->dev != dev || (dinum && d->dinum != dinum))
+      continue;
+    dunhash(d);
+    // to the end of the LRU list, to be reused first
+    d->prev->next = d->next;
+    d->next->prev = d->prev;
+    d->prev = dcache.head.prev;
+    d->next = &dcache.head;
+    dcache.head.prev->next = d;
+    dcache.head.prev = d;
+  }
+  release(&dcache.lock);
+}
+
+// Copy name cache statistics to st.
+void
+dstat(struct iostat *st)
+{
+  acquire(&dcache.lock);
+  st->dhits = dcache.hits;
+  st->dneghits = dcache.neghits;
+  st->dmisses = dcache.misses;
+  release(&dcache.lock);
+}
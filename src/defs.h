@@ -6,17 +6,30 @@ struct pipe;
 struct proc;
 struct rtcdate;
 struct spinlock;
+struct sleeplock;
 struct stat;
 struct superblock;
 struct bdev_ops;
 struct bdev;
 struct filesystem_type;
+struct iostat;
+struct kmem_cache;
 
 // bio.c
 void            binit(void);
 struct buf*     bread(uint, uint);
+void            breada(uint, uint);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
+void            bwritev(struct buf**, int);
+void            bstat(struct iostat*);
+void            bcacheinfo(uint);
+void            bshrink(void);
+void            bunpin(struct buf*);
+void            binval(uint);
+void            bflush(uint);
+void            bwbinit(uint);
+void            bwbtimer(void);
 
 // console.c
 void            consoleinit(void);
@@ -58,6 +71,12 @@ int             writei(struct inode*, char*, uint, uint);
 void            ideinit(void);
 void            ideintr(int scflag);
 void            iderw(struct buf*);
+void            iderwv(struct buf**, int);
+void            idesubmit(struct buf*);
+void            idesubmitv(struct buf**, int);
+void            ideiowait(struct buf*);
+void            idestat(struct iostat*);
+int             idedma(int);
 
 // ioapic.c
 void            ioapicenable(int irq, int cpu);
@@ -66,7 +85,11 @@ void            ioapicinit(void);
 
 // kalloc.c
 char*           kalloc(void);
+int             kfreepages(void);
 void            kfree(char*);
+void            kdup(char*);
+int             krefs(char*);
+void            kstat(struct iostat*);
 void            kinit1(void*, void*);
 void            kinit2(void*, void*);
 
@@ -84,9 +107,15 @@ void            microdelay(int);
 
 // log.c
 void            initlog(int dev);
+int             initlogfile(struct inode*, uint, void (*)(int, int));
+int             log_enabled(int);
 void            log_write(struct buf*);
+void            log_write_data(struct buf*);
 void            begin_op();
+void            begin_opn(int);
 void            end_op();
+void            log_force(int);
+void            logtimer(void);
 
 // mp.c
 extern int      ismp;
@@ -103,6 +132,7 @@ int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
 int             piperead(struct pipe*, char*, int);
 int             pipewrite(struct pipe*, char*, int);
+void            pipeinit(void);
 
 //PAGEBREAK: 16
 // proc.c
@@ -111,6 +141,7 @@ void            exit(void);
 int             fork(void);
 int             growproc(int);
 int             kill(int);
+struct proc*    kthread(char*, void(*)(void*), void*);
 void            pinit(void);
 void            procdump(void);
 void            scheduler(void) __attribute__((noreturn));
@@ -124,6 +155,20 @@ void            yield(void);
 // swtch.S
 void            swtch(struct context**, struct context*);
 
+// slab.c
+void            kmem_cache_init(struct kmem_cache*, char*, uint, void (*)(void*));
+void*           kmem_cache_alloc(struct kmem_cache*);
+void            kmem_cache_free(struct kmem_cache*, void*);
+void            kmeminit(void);
+void*           kmalloc(uint);
+void            kmfree(void*);
+
+// sleeplock.c
+void            acquiresleep(struct sleeplock*);
+void            releasesleep(struct sleeplock*);
+int             holdingsleep(struct sleeplock*);
+void            initsleeplock(struct sleeplock*, char*);
+
 // spinlock.c
 void            acquire(struct spinlock*);
 void            getcallerpcs(void*, uint*);
@@ -184,6 +229,15 @@ void            switchuvm(struct proc*);
 void            switchkvm(void);
 int             copyout(pde_t*, uint, void*, uint);
 void            clearpteu(pde_t *pgdir, char *uva);
+int             pgfault(uint, uint);
+int             uvmtouch(uint, uint);
+
+// dcache.c
+void            dinit(void);
+int             dlookup(struct inode*, char*, uint*);
+void            denter(struct inode*, char*, uint);
+void            dpurge(uint, uint);
+void            dstat(struct iostat*);
 
 // device.c
 void            bdevtableinit(void);
@@ -196,6 +250,7 @@ int             inits5fs(void);
 
 // ext2.c
 int             initext2fs(void);
+void            ext2stat(struct iostat*);
 
 // number of elements in fixed-size array
 #define NELEM(x) (sizeof(x)/sizeof((x)[0]))
@@ -0,0 +1,117 @@
+// Time creating, looking up and removing many files in one
+// directory.
+//
+// usage: dirbench dir [n]
+//
+// Makes dir, creates n (default 10000) empty files in it,
+// opens each of them again by name and then removes them all.
+// The s5 root has too few inodes for that, so point it at a
+// directory on a mounted ext2.img; with dir_index the
+// directory gets a hashed index once its first block fills.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "fcntl.h"
+#include "iostat.h"
+
+char path[128];
+
+// path = dir/f<i>
+void
+name(char *dir, int i)
+{
+  char num[12];
+  int n, k;
+
+  n = strlen(dir);
+  memmove(path, dir, n);
+  path[n++] = '/';
+  path[n++] = 'f';
+  k = 0;
+  do {
+    num[k++] = '0' + i % 10;
+    i /= 10;
+  } while(i > 0);
+  while(k > 0)
+    path[n++] = num[--k];
+  path[n] = 0;
+}
+
+void
+report(char *what, int n, int t, struct iostat *s0, struct iostat *s1)
+{
+  printf(1, "  %s: %d files in %d ticks", what, n, t);
+  if(t > 0)
+    printf(1, " (%d/s)", n * 100 / t);
+  printf(1, ", %d breads, %d from disk\n",
+    (s1->hits + s1->misses) - (s0->hits + s0->misses), s1->misses - s0->misses);
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct iostat s0, s1;
+  int fd, i, n, t;
+
+  if(argc < 2){
+    printf(2, "usage: dirbench dir [n]\n");
+    exit();
+  }
+  n = 10000;
+  if(argc > 2)
+    n = atoi(argv[2]);
+  if(strlen(argv[1]) > sizeof(path) - 16){
+    printf(2, "dirbench: %s: name too long\n", argv[1]);
+    exit();
+  }
+  if(mkdir(argv[1]) < 0){
+    printf(2, "dirbench: cannot create %s\n", argv[1]);
+    exit();
+  }
+
+  iostat(&s0);
+  t = uptime();
+  for(i = 0; i < n; i++){
+    name(argv[1], i);
+    if((fd = open(path, O_CREATE | O_RDWR)) < 0){
+      printf(2, "dirbench: cannot create %s\n", path);
+      n = i;
+      break;
+    }
+    close(fd);
+  }
+  t = uptime() - t;
+  iostat(&s1);
+  report("create", n, t, &s0, &s1);
+
+  iostat(&s0);
+  t = uptime();
+  for(i = 0; i < n; i++){
+    name(argv[1], i);
+    if((fd = open(path, O_RDONLY)) < 0){
+      printf(2, "dirbench: lost %s\n", path);
+      exit();
+    }
+    close(fd);
+  }
+  t = uptime() - t;
+  iostat(&s1);
+  report("lookup", n, t, &s0, &s1);
+
+  iostat(&s0);
+  t = uptime();
+  for(i = 0; i < n; i++){
+    name(argv[1], i);
+    if(unlink(path) < 0){
+      printf(2, "dirbench: cannot remove %s\n", path);
+      exit();
+    }
+  }
+  t = uptime() - t;
+  iostat(&s1);
+  report("remove", n, t, &s0, &s1);
+
+  unlink(argv[1]);
+  exit();
+}
@@ -0,0 +1,112 @@
+// Compare PIO and DMA disk throughput.
+//
+// usage: dmabench file [mb]
+//
+// Writes a file of mb megabytes (default 4), pushes it out
+// of the buffer cache by using up memory and reads it back,
+// once with IDE DMA off and once with it on.  A file that
+// big needs ext2, so point it at a mounted ext2.img.
+// The read pass also reports how many of ext2's block
+// lookups the extent cache answered.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "fcntl.h"
+#include "iostat.h"
+
+char buf[4096];
+
+// Use up memory so the kernel shrinks the buffer cache.
+void
+dropcache(void)
+{
+  int n;
+
+  n = 0;
+  while(sbrk(64*4096) != (char*)-1)
+    n += 64;
+  sbrk(-n*4096);
+}
+
+void
+rate(char *what, int kb, int t)
+{
+  printf(1, "  %s: %d KB in %d ticks", what, kb, t);
+  if(t > 0)
+    printf(1, " (%d KB/s)", kb * 100 / t);
+  printf(1, "\n");
+}
+
+void
+run(char *path, int mb)
+{
+  struct iostat s0, s1;
+  int fd, i, n, t, h, m;
+
+  unlink(path);
+  if((fd = open(path, O_CREATE | O_RDWR)) < 0){
+    printf(1, "dmabench: cannot create %s\n", path);
+    exit();
+  }
+  t = uptime();
+  for(i = 0; i < mb * 256; i++){
+    if(write(fd, buf, sizeof(buf)) != sizeof(buf)){
+      printf(1, "dmabench: write %s failed\n", path);
+      exit();
+    }
+  }
+  close(fd);
+  rate("write", mb * 1024, uptime() - t);
+
+  dropcache();
+  iostat(&s0);
+  if((fd = open(path, O_RDONLY)) < 0){
+    printf(1, "dmabench: cannot open %s\n", path);
+    exit();
+  }
+  t = uptime();
+  n = 0;
+  while((i = read(fd, buf, sizeof(buf))) > 0)
+    n += i;
+  t = uptime() - t;
+  close(fd);
+  iostat(&s1);
+  rate("read", n / 1024, t);
+  printf(1, "  %d disk commands\n", s1.ioreqs - s0.ioreqs);
+  h = s1.ehits - s0.ehits;
+  m = s1.emisses - s0.emisses;
+  if(h + m > 0)
+    printf(1, "  bmap: %d of %d from the extent cache (%d%%)\n",
+      h, h + m, h * 100 / (h + m));
+}
+
+int
+main(int argc, char *argv[])
+{
+  int mb, old;
+
+  if(argc < 2){
+    printf(2, "usage: dmabench file [mb]\n");
+    exit();
+  }
+  mb = 4;
+  if(argc > 2)
+    mb = atoi(argv[2]);
+  memset(buf, 'x', sizeof(buf));
+
+  if((old = dmactl(0)) < 0){
+    printf(1, "dmabench: no DMA controller, PIO only\n");
+    printf(1, "PIO:\n");
+    run(argv[1], mb);
+  } else {
+    printf(1, "PIO:\n");
+    run(argv[1], mb);
+    dmactl(1);
+    printf(1, "DMA:\n");
+    run(argv[1], mb);
+    dmactl(old);
+  }
+  unlink(argv[1]);
+  exit();
+}
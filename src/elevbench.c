@@ -0,0 +1,137 @@
+// Concurrent readers on distant parts of a disk.
+//
+// usage: elevbench dir [nreader]
+//
+// Creates nreader files of NKB KB under dir, each in a
+// directory of its own; ext2 spreads directories over its
+// block groups, so on a mounted ext2.img the files end up
+// far apart.  The files are pushed out of the buffer cache
+// by using up memory, and then read all at once, one KB at
+// a time.  With the disk queue kept in C-LOOK order, the
+// requests of different readers are served in one sweep
+// across the disk instead of seeking back and forth, and
+// adjacent ones go out as one command.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "fcntl.h"
+#include "iostat.h"
+
+#define NKB   256
+#define MAXRD 8
+
+char buf[1024];
+
+void
+mkpath(char *path, char *dir, int i, int file)
+{
+  int n;
+
+  strcpy(path, dir);
+  n = strlen(path);
+  path[n++] = '/';
+  path[n++] = 'e';
+  path[n++] = 'l';
+  path[n++] = '0' + i;
+  path[n] = 0;
+  if(file){
+    path[n++] = '/';
+    path[n++] = 'f';
+    path[n] = 0;
+  }
+}
+
+void
+mkfile(char *path)
+{
+  int fd, i;
+
+  if((fd = open(path, O_CREATE | O_RDWR)) < 0){
+    printf(1, "elevbench: cannot create %s\n", path);
+    exit();
+  }
+  for(i = 0; i < NKB; i++){
+    memset(buf, 'a' + i % 26, sizeof(buf));
+    if(write(fd, buf, sizeof(buf)) != sizeof(buf)){
+      printf(1, "elevbench: write %s failed\n", path);
+      exit();
+    }
+  }
+  close(fd);
+}
+
+// Use up memory so the kernel shrinks the buffer cache.
+void
+dropcache(void)
+{
+  int n;
+
+  n = 0;
+  while(sbrk(64*4096) != (char*)-1)
+    n += 64;
+  sbrk(-n*4096);
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct iostat s0, s1;
+  char path[64];
+  int i, n, fd, t, nreader;
+
+  if(argc < 2){
+    printf(2, "usage: elevbench dir [nreader]\n");
+    exit();
+  }
+  nreader = 4;
+  if(argc > 2)
+    nreader = atoi(argv[2]);
+  if(nreader < 1 || nreader > MAXRD || strlen(argv[1]) > 32){
+    printf(2, "elevbench: 1..%d readers, short dir\n", MAXRD);
+    exit();
+  }
+
+  for(i = 0; i < nreader; i++){
+    mkpath(path, argv[1], i, 0);
+    mkdir(path);
+    mkpath(path, argv[1], i, 1);
+    mkfile(path);
+  }
+  dropcache();
+
+  iostat(&s0);
+  t = uptime();
+  for(i = 0; i < nreader; i++){
+    if(fork() == 0){
+      mkpath(path, argv[1], i, 1);
+      if((fd = open(path, O_RDONLY)) < 0){
+        printf(1, "elevbench: cannot open %s\n", path);
+        exit();
+      }
+      while((n = read(fd, buf, sizeof(buf))) > 0)
+        ;
+      close(fd);
+      exit();
+    }
+  }
+  for(i = 0; i < nreader; i++)
+    wait();
+  t = uptime() - t;
+  iostat(&s1);
+
+  printf(1, "%d readers, %d KB each: %d ticks", nreader, NKB, t);
+  if(t > 0)
+    printf(1, " (%d KB/s)", nreader * NKB * 100 / t);
+  printf(1, "\n%d misses, %d disk commands, %d requests merged\n",
+         s1.misses - s0.misses, s1.ioreqs - s0.ioreqs,
+         s1.iomerged - s0.iomerged);
+
+  for(i = 0; i < nreader; i++){
+    mkpath(path, argv[1], i, 1);
+    unlink(path);
+    mkpath(path, argv[1], i, 0);
+    unlink(path);
+  }
+  exit();
+}
@@ -12,11 +12,12 @@ int
 exec(char *path, char **argv)
 {
   char *s, *last;
-  int i, off;
+  int i, off, nseg;
   uint argc, sz, sp, ustack[3+MAXARG+1];
   struct elfhdr elf;
-  struct inode *ip;
+  struct inode *ip, *image, *oldimage;
   struct proghdr ph;
+  struct vmseg seg[NVMSEG];
   pde_t *pgdir, *oldpgdir;
 
   begin_op();
@@ -26,6 +27,7 @@ exec(char *path, char **argv)
   }
   ip->iops->ilock(ip);
   pgdir = 0;
+  image = 0;
 
   // Check ELF header
   if(ip->iops->readi(ip, (char*)&elf, 0, sizeof(elf)) < sizeof(elf))
@@ -36,22 +38,45 @@ exec(char *path, char **argv)
   if((pgdir = setupkvm()) == 0)
     goto bad;
 
-  // Load program into memory.
+  // Map the program.  Its pages are read in from ip when
+  // the program first touches them (see pgfault), except
+  // for segments beyond the first NVMSEG, which are loaded
+  // now.
   sz = 0;
+  nseg = 0;
   for(i=0, off=elf.phoff; i<elf.phnum; i++, off+=sizeof(ph)){
     if(ip->iops->readi(ip, (char*)&ph, off, sizeof(ph)) != sizeof(ph))
       goto bad;
     if(ph.type != ELF_PROG_LOAD)
       continue;
-    if(ph.memsz < ph.filesz)
+    if(ph.memsz < ph.filesz || ph.vaddr % PGSIZE != 0)
       goto bad;
+    if(ph.vaddr + ph.memsz < ph.vaddr || ph.vaddr + ph.memsz >= KERNBASE)
+      goto bad;
+    // Segments must come in address order without overlap:
+    // pages below sz may not be mapped yet for allocuvm and
+    // loaduvm, and pgfault() could not tell which one to use.
+    if(ph.vaddr < sz)
+      goto bad;
+    if(nseg < NVMSEG){
+      seg[nseg].va = ph.vaddr;
+      seg[nseg].end = ph.vaddr + ph.memsz;
+      seg[nseg].off = ph.off;
+      seg[nseg].filesz = ph.filesz;
+      nseg++;
+      if(ph.vaddr + ph.memsz > sz)
+        sz = ph.vaddr + ph.memsz;
+      continue;
+    }
     if((sz = allocuvm(pgdir, sz, ph.vaddr + ph.memsz)) == 0)
       goto bad;
     if(loaduvm(pgdir, (char*)ph.vaddr, ip, ph.off, ph.filesz) < 0)
       goto bad;
   }
-  iunlockput(ip);
+  // Keep the reference to ip for paging in.
+  ip->iops->iunlock(ip);
   end_op();
+  image = ip;
   ip = 0;
 
   // Allocate two pages at the next page boundary.
@@ -89,12 +114,21 @@ exec(char *path, char **argv)
 
   // Commit to the user image.
   oldpgdir = proc->pgdir;
+  oldimage = proc->execip;
   proc->pgdir = pgdir;
   proc->sz = sz;
+  proc->execip = image;
+  proc->nseg = nseg;
+  memmove(proc->seg, seg, sizeof(seg));
   proc->tf->eip = elf.entry;  // main
   proc->tf->esp = sp;
   switchuvm(proc);
   freevm(oldpgdir);
+  if(oldimage){
+    begin_op();
+    iput(oldimage);
+    end_op();
+  }
   return 0;
 
  bad:
@@ -104,5 +138,10 @@ exec(char *path, char **argv)
     iunlockput(ip);
     end_op();
   }
+  if(image){
+    begin_op();
+    iput(image);
+    end_op();
+  }
   return -1;
 }
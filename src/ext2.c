@@ -11,6 +11,8 @@
 #include "vfsmount.h"
 #include "ext2.h"
 #include "find_bits.h"
+#include "iostat.h"
+#include "slab.h"
 
 #define in_range(b, first, len) ((b) >= (first) && (b) <= (first) + (len) - 1)
 #define ext2_find_next_zero_bit find_next_zero_bit
@@ -30,6 +32,8 @@ static struct buf * read_block_bitmap(struct superblock *sb,
 static void group_adjust_blocks(struct superblock *sb, int group_no,
                                 struct ext2_group_desc *desc, struct buf *bh,
                                 int count);
+static void ext2_rsv_drop(struct superblock *sb, uint inum);
+static void ext2_gsum_scan(struct superblock *sb, int group, struct buf *bh);
 
 typedef struct {
   uint32 *p;
@@ -52,54 +56,47 @@ static inline int verify_chain(Indirect *from, Indirect *to)
 }
 
 
-static struct {
-  struct spinlock lock;
-  struct ext2_inode_info ei[NINODE];
-} ext2_ei_pool; // It is a Pool of S5 Superblock Filesystems
+// In-memory ext2 inodes come from their own slab cache and
+// are kept zeroed while free; ext2_cleanup() zeroes them
+// again before giving them back.
+static struct kmem_cache ext2_ei_cache;
+
+static void
+ext2_ei_ctor(void *v)
+{
+  memset(v, 0, sizeof(struct ext2_inode_info));
+}
 
 struct ext2_inode_info*
 alloc_ext2_inode_info()
 {
-  struct ext2_inode_info *ei;
-
-  acquire(&ext2_ei_pool.lock);
-  for (ei = &ext2_ei_pool.ei[0]; ei < &ext2_ei_pool.ei[NINODE]; ei++) {
-    if (ei->flags == INODE_FREE) {
-      ei->flags |= INODE_USED;
-      release(&ext2_ei_pool.lock);
-
-      return ei;
-    }
-  }
-  release(&ext2_ei_pool.lock);
-
-  return 0;
+  return kmem_cache_alloc(&ext2_ei_cache);
 }
 
-static struct {
-  struct spinlock lock;
-  struct ext2_sb_info sb[MAXVFSSIZE];
-} ext2_sb_pool; // It is a Pool of S5 Superblock Filesystems
-
 struct ext2_sb_info*
 alloc_ext2_sb()
 {
-  struct ext2_sb_info *sb;
-
-  acquire(&ext2_sb_pool.lock);
-  for (sb = &ext2_sb_pool.sb[0]; sb < &ext2_sb_pool.sb[MAXVFSSIZE]; sb++) {
-    if (sb->flags == SB_FREE) {
-      sb->flags |= SB_USED;
-      release(&ext2_sb_pool.lock);
+  struct ext2_sb_info *sbi;
 
-      return sb;
-    }
+  if ((sbi = kmalloc(sizeof(*sbi))) == 0)
+    return 0;
+  memset(sbi, 0, sizeof(*sbi));
+  if ((sbi->s_gsum = (struct ext2_group_sum *)kalloc()) == 0) {
+    kmfree(sbi);
+    return 0;
   }
-  release(&ext2_sb_pool.lock);
+  return sbi;
+}
 
-  return 0;
+static void
+free_ext2_sb(struct ext2_sb_info *sbi)
+{
+  kfree((char *)sbi->s_gsum);
+  kmfree(sbi);
 }
 
+static void ext2_bwrite(struct buf *b);
+
 struct vfs_operations ext2_ops = {
   .fs_init = &ext2fs_init,
   .mount   = &ext2_mount,
@@ -111,7 +108,7 @@ struct vfs_operations ext2_ops = {
   .bzero   = &ext2_bzero,
   .bfree   = &ext2_bfree,
   .brelse  = &brelse,
-  .bwrite  = &bwrite,
+  .bwrite  = &ext2_bwrite,
   .bread   = &bread,
   .namecmp = &ext2_namecmp
 };
@@ -122,6 +119,7 @@ struct inode_operations ext2_iops = {
   .itrunc     = &ext2_itrunc,
   .cleanup    = &ext2_cleanup,
   .bmap       = &ext2_bmap,
+  .blookup    = &ext2_blookup,
   .ilock      = &ext2_ilock,
   .iunlock    = &generic_iunlock,
   .stati      = &generic_stati,
@@ -138,11 +136,40 @@ struct filesystem_type ext2fs = {
   .iops = &ext2_iops
 };
 
+/*
+ * Reservation windows.  When a file allocates, the free blocks
+ * right behind the run it got (up to EXT2_RSVBLOCKS) become its
+ * window: other files do not allocate there, and the file's
+ * next allocation starts at the window, so appends stay
+ * contiguous even with several writers.  Windows only live in
+ * memory and are advisory; each file system has EXT2_NRSV of
+ * them and the least recently used one is taken over when a
+ * new file needs one.
+ */
+#define EXT2_RSVBLOCKS  64  // Size of a reservation window
+#define EXT2_NRSV       16  // Windows per file system
+
+struct ext2_rsv {
+  uint inum;            // Owner, 0 if the slot is free
+  ext2_fsblk_t start;   // Next block to hand out
+  ext2_fsblk_t end;     // One past the window
+  uint stamp;
+};
+
+static struct {
+  struct spinlock lock;
+  struct ext2_rsv w[EXT2_NRSV];
+  uint clock;
+} rsvtab[NDEV];
+
 int
 initext2fs(void)
 {
-  initlock(&ext2_sb_pool.lock, "ext2_sb_pool");
-  /* initlock(&ext2_inode_pool.lock, "ext2_inode_pool"); */
+  int i;
+
+  kmem_cache_init(&ext2_ei_cache, "ext2_inode", sizeof(struct ext2_inode_info), ext2_ei_ctor);
+  for (i = 0; i < NDEV; i++)
+    initlock(&rsvtab[i].lock, "ext2_rsv");
   return register_fs(&ext2fs);
 }
 
@@ -152,6 +179,136 @@ ext2fs_init(void)
   return 0;
 }
 
+// Is b the superblock or a group descriptor block?  Those are
+// held for as long as the volume is mounted.
+static int
+ext2_held(struct buf *b)
+{
+  struct ext2_sb_info *sbi = EXT2_SB(&sb[b->dev]);
+  int i;
+
+  if (b == sbi->s_sbh)
+    return 1;
+  for (i = 0; i < sbi->s_gdb_count; i++)
+    if (b == sbi->s_group_desc[i])
+      return 1;
+  return 0;
+}
+
+// Write a metadata block: through the journal if the
+// volume has one, straight to disk otherwise.
+static void
+ext2_bwrite(struct buf *b)
+{
+  if (log_enabled(b->dev))
+    log_write(b);
+  else if (ext2_held(b))
+    bwritev(&b, 1);  // never released, so never written behind
+  else
+    bwrite(b);
+}
+
+// Write a file data block.  With a journal it is written in
+// place before the metadata that points to it commits
+// (ordered mode), instead of synchronously.
+static void
+ext2_bwrite_data(struct buf *b)
+{
+  if (log_enabled(b->dev))
+    log_write_data(b);
+  else
+    bwrite(b);
+}
+
+// Re-read the superblock and the group descriptors after the
+// journal wrote blocks behind the cache's back.
+static void
+ext2_reload(int dev)
+{
+  struct ext2_sb_info *sbi = EXT2_SB(&sb[dev]);
+  int i;
+
+  ext2_ops.brelse(sbi->s_sbh);
+  for (i = 0; i < sbi->s_gdb_count; i++)
+    ext2_ops.brelse(sbi->s_group_desc[i]);
+  binval(dev);
+  free_ext2_sb(sbi);
+  ext2_ops.readsb(dev, &sb[dev]);
+}
+
+// Called by the log before its first commit after mounting
+// and again once recovery has emptied the ring.  The ring is
+// not made of jbd records, and Linux or e2fsck would replay
+// or reset it as if it were, so meanwhile the volume carries
+// an incompatible feature of our own, which they refuse.
+//
+// The flag has to be on disk before the ring holds anything,
+// so it cannot go through the ring; the home superblock is
+// changed by a raw read-modify-write, which keeps the cached
+// copy's uncommitted changes off the disk.  The cached copy
+// gets the same flag so that installing it keeps the flag.
+static void
+ext2_ring_busy(int dev, int busy)
+{
+  struct ext2_sb_info *sbi = EXT2_SB(&sb[dev]);
+  struct ext2_superblock *es;
+  struct buf io, *iov;
+  uint off;
+
+  if (!(sbi->s_es->s_feature_incompat & EXT2_FEATURE_INCOMPAT_XV6_LOG) == !busy)
+    return;
+  off = (char *)sbi->s_es - (char *)sbi->s_sbh->data;
+  memset(&io, 0, sizeof(io));
+  io.dev = dev;
+  io.blockno = sbi->s_sbh->blockno;
+  io.bsize = sbi->s_sbh->bsize;
+  if ((io.data = (uchar *)kalloc()) == 0)
+    panic("ext2_ring_busy");
+  io.flags = B_BUSY;
+  iov = &io;
+  iderwv(&iov, 1);
+
+  es = (struct ext2_superblock *)(io.data + off);
+  if (busy) {
+    es->s_feature_incompat |= EXT2_FEATURE_INCOMPAT_XV6_LOG;
+    sbi->s_es->s_feature_incompat |= EXT2_FEATURE_INCOMPAT_XV6_LOG;
+  } else {
+    es->s_feature_incompat &= ~EXT2_FEATURE_INCOMPAT_XV6_LOG;
+    sbi->s_es->s_feature_incompat &= ~EXT2_FEATURE_INCOMPAT_XV6_LOG;
+  }
+  io.flags = B_BUSY | B_DIRTY;
+  iderwv(&iov, 1);
+  kfree((char *)io.data);
+}
+
+// Start the journal of an ext3-style volume and replay it.
+// The log lives in the journal inode's blocks, after the
+// first one, so the jbd superblock there is left alone.
+static void
+ext2_journal_init(int dev)
+{
+  struct ext2_superblock *es = EXT2_SB(&sb[dev])->s_es;
+  struct inode *jip;
+  int n;
+
+  if (!(es->s_feature_compat & EXT3_FEATURE_COMPAT_HAS_JOURNAL) ||
+      es->s_journal_inum == 0) {
+    cprintf("ext2: dev %d has no journal, writes are not logged\n", dev);
+    return;
+  }
+
+  jip = ext2_iget(dev, es->s_journal_inum);
+  ext2_iops.ilock(jip);
+  n = initlogfile(jip, 1, ext2_ring_busy);
+  ext2_iops.iunlock(jip);
+  iput(jip);
+
+  if (n < 0)
+    cprintf("ext2: dev %d journal too small, writes are not logged\n", dev);
+  else if (n > 0)
+    ext2_reload(dev);
+}
+
 int
 ext2_mount(struct inode *devi, struct inode *ip)
 {
@@ -160,6 +317,9 @@ ext2_mount(struct inode *devi, struct inode *ip)
   // Read the Superblock
   ext2_ops.readsb(devi->minor, &sb[devi->minor]);
 
+  // Replay the journal before anything else is read
+  ext2_journal_init(devi->minor);
+
   // Read the root device
   struct inode *devrtip = ext2_ops.getroot(devi->major, devi->minor);
 
@@ -303,6 +463,8 @@ ext2_readsb(int dev, struct superblock *sb)
 
   if((sb->flags & SB_NOT_LOADED) == 0) {
     sbi = alloc_ext2_sb(); // Allocate a new S5 sb struct to the superblock.
+    if (sbi == 0)
+      panic("No memory for the ext2 superblock");
   } else{
     sbi = sb->fs_info;
   }
@@ -341,6 +503,7 @@ ext2_readsb(int dev, struct superblock *sb)
 
     es = (struct ext2_superblock *) (((char *)bp->data) + offset);
     sbi->s_es = es;
+    sbi->s_sbh = bp;
 
     if (es->s_magic != EXT2_SUPER_MAGIC) {
       panic("error: ext2 magic mismatch");
@@ -394,6 +557,13 @@ ext2_readsb(int dev, struct superblock *sb)
   }
 
   sbi->s_gdb_count = db_count;
+
+  // Free counts come from the descriptors; the longest runs
+  // are learned as the allocator reads the bitmaps.
+  for (i = 0; i < sbi->s_groups_count && i < EXT2_MAX_GSUM; i++) {
+    sbi->s_gsum[i].free = ext2_get_group_desc(sb, i, 0)->bg_free_blocks_count;
+    sbi->s_gsum[i].maxrun = EXT2_GSUM_UNKNOWN;
+  }
 }
 
 /*
@@ -529,6 +699,724 @@ ext2_bfree(int dev, uint b)
   panic("ext2 bfree op not defined");
 }
 
+/*
+ * Hashed directory index, after fs/ext3/hash.c and namei.c.
+ * Lookups hash the name, walk the index down to the one leaf
+ * block that can hold it and scan only that block.  A
+ * directory gets an index when its first block fills up and
+ * the file system has dir_index; leaves that fill up are
+ * split in two by hash.  Anything the code does not
+ * understand makes it fall back to the linear directory
+ * code, clearing EXT2_INDEX_FL when it has to write.
+ */
+
+#define DX_DELTA 0x9E3779B9
+
+static void
+dx_tea(uint32 buf[4], uint32 *in)
+{
+  uint32 sum = 0;
+  uint32 b0 = buf[0], b1 = buf[1];
+  uint32 a = in[0], b = in[1], c = in[2], d = in[3];
+  int n = 16;
+
+  do {
+    sum += DX_DELTA;
+    b0 += ((b1 << 4)+a) ^ (b1+sum) ^ ((b1 >> 5)+b);
+    b1 += ((b0 << 4)+c) ^ (b0+sum) ^ ((b0 >> 5)+d);
+  } while(--n);
+
+  buf[0] += b0;
+  buf[1] += b1;
+}
+
+#define DX_ROL(x, s)  (((x) << (s)) | ((x) >> (32 - (s))))
+#define DX_F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define DX_G(x, y, z) (((x) & (y)) + (((x) ^ (y)) & (z)))
+#define DX_H(x, y, z) ((x) ^ (y) ^ (z))
+#define DX_ROUND(f, a, b, c, d, x, s) \
+  (a += f(b, c, d) + x, a = DX_ROL(a, s))
+#define DX_K1 0
+#define DX_K2 013240474631UL
+#define DX_K3 015666365641UL
+
+static void
+dx_half_md4(uint32 buf[4], uint32 *in)
+{
+  uint32 a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+  DX_ROUND(DX_F, a, b, c, d, in[0] + DX_K1,  3);
+  DX_ROUND(DX_F, d, a, b, c, in[1] + DX_K1,  7);
+  DX_ROUND(DX_F, c, d, a, b, in[2] + DX_K1, 11);
+  DX_ROUND(DX_F, b, c, d, a, in[3] + DX_K1, 19);
+  DX_ROUND(DX_F, a, b, c, d, in[4] + DX_K1,  3);
+  DX_ROUND(DX_F, d, a, b, c, in[5] + DX_K1,  7);
+  DX_ROUND(DX_F, c, d, a, b, in[6] + DX_K1, 11);
+  DX_ROUND(DX_F, b, c, d, a, in[7] + DX_K1, 19);
+
+  DX_ROUND(DX_G, a, b, c, d, in[1] + DX_K2,  3);
+  DX_ROUND(DX_G, d, a, b, c, in[3] + DX_K2,  5);
+  DX_ROUND(DX_G, c, d, a, b, in[5] + DX_K2,  9);
+  DX_ROUND(DX_G, b, c, d, a, in[7] + DX_K2, 13);
+  DX_ROUND(DX_G, a, b, c, d, in[0] + DX_K2,  3);
+  DX_ROUND(DX_G, d, a, b, c, in[2] + DX_K2,  5);
+  DX_ROUND(DX_G, c, d, a, b, in[4] + DX_K2,  9);
+  DX_ROUND(DX_G, b, c, d, a, in[6] + DX_K2, 13);
+
+  DX_ROUND(DX_H, a, b, c, d, in[3] + DX_K3,  3);
+  DX_ROUND(DX_H, d, a, b, c, in[7] + DX_K3,  9);
+  DX_ROUND(DX_H, c, d, a, b, in[2] + DX_K3, 11);
+  DX_ROUND(DX_H, b, c, d, a, in[6] + DX_K3, 15);
+  DX_ROUND(DX_H, a, b, c, d, in[1] + DX_K3,  3);
+  DX_ROUND(DX_H, d, a, b, c, in[5] + DX_K3,  9);
+  DX_ROUND(DX_H, c, d, a, b, in[0] + DX_K3, 11);
+  DX_ROUND(DX_H, b, c, d, a, in[4] + DX_K3, 15);
+
+  buf[0] += a;
+  buf[1] += b;
+  buf[2] += c;
+  buf[3] += d;
+}
+
+// The original ext3 hash.
+static uint32
+dx_legacy(const char *name, int len, int unsig)
+{
+  uint32 hash, hash0 = 0x12a3fe2d, hash1 = 0x37abe8f9;
+  int c;
+
+  while (len--) {
+    c = unsig ? *(uchar *)name : *(signed char *)name;
+    name++;
+    hash = hash1 + (hash0 ^ (c * 7152373));
+    if (hash & 0x80000000)
+      hash -= 0x7fffffff;
+    hash1 = hash0;
+    hash0 = hash;
+  }
+  return hash0 << 1;
+}
+
+// Pack up to num words of the name into buf, padding with the
+// length.  Whether chars are signed depends on the file system.
+static void
+dx_str2hashbuf(const char *msg, int len, uint32 *buf, int num, int unsig)
+{
+  uint32 pad, val;
+  int i, c;
+
+  pad = (uint32)len | ((uint32)len << 8);
+  pad |= pad << 16;
+
+  val = pad;
+  if (len > num*4)
+    len = num * 4;
+  for (i = 0; i < len; i++) {
+    c = unsig ? ((uchar *)msg)[i] : ((signed char *)msg)[i];
+    val = c + (val << 8);
+    if ((i % 4) == 3) {
+      *buf++ = val;
+      val = pad;
+      num--;
+    }
+  }
+  if (--num >= 0)
+    *buf++ = val;
+  while (--num >= 0)
+    *buf++ = pad;
+}
+
+static uint32
+dx_hash(struct superblock *s, int version, const char *name, int len)
+{
+  struct ext2_superblock *es = EXT2_SB(s)->s_es;
+  uint32 buf[4], in[8], hash;
+  int i, unsig;
+
+  buf[0] = 0x67452301;
+  buf[1] = 0xefcdab89;
+  buf[2] = 0x98badcfe;
+  buf[3] = 0x10325476;
+  for (i = 0; i < 4; i++) {
+    if (es->s_hash_seed[i])
+      break;
+  }
+  if (i < 4)
+    memmove(buf, es->s_hash_seed, sizeof(buf));
+
+  unsig = version >= DX_HASH_LEGACY_UNSIGNED;
+  switch (version) {
+  case DX_HASH_LEGACY:
+  case DX_HASH_LEGACY_UNSIGNED:
+    hash = dx_legacy(name, len, unsig);
+    break;
+  case DX_HASH_HALF_MD4:
+  case DX_HASH_HALF_MD4_UNSIGNED:
+    for (; len > 0; len -= 32, name += 32) {
+      dx_str2hashbuf(name, len, in, 8, unsig);
+      dx_half_md4(buf, in);
+    }
+    hash = buf[1];
+    break;
+  case DX_HASH_TEA:
+  case DX_HASH_TEA_UNSIGNED:
+    for (; len > 0; len -= 16, name += 16) {
+      dx_str2hashbuf(name, len, in, 4, unsig);
+      dx_tea(buf, in);
+    }
+    hash = buf[0];
+    break;
+  default:
+    panic("dx_hash");
+  }
+  // The low bit marks a hash continued from the previous leaf.
+  hash &= ~1;
+  if (hash == (0x7fffffff << 1))
+    hash = (0x7fffffff - 1) << 1;
+  return hash;
+}
+
+#define dx_countlimit(e) ((struct dx_countlimit *)(e))
+#define dx_root_limit(bs) (((bs) - DX_ROOT_INFO - sizeof(struct dx_root_info)) / sizeof(struct dx_entry))
+#define dx_node_limit(bs) (((bs) - DX_NODE_HDR) / sizeof(struct dx_entry))
+
+struct dx_frame {
+  struct buf *bh;
+  struct dx_entry *entries;
+  struct dx_entry *at;
+};
+
+static int
+is_dx(struct inode *dp)
+{
+  struct ext2_inode_info *ei = dp->i_private;
+
+  return (ei->i_ei.i_flags & EXT2_INDEX_FL) != 0;
+}
+
+static void
+dx_release(struct dx_frame *frame, int n)
+{
+  while (n-- > 0)
+    ext2_ops.brelse(frame[n].bh);
+}
+
+// Read logical block blk of directory dp, refusing blocks past
+// its end (ext2_bmap would allocate them).
+static struct buf *
+dx_bread(struct inode *dp, uint blk)
+{
+  if (blk == 0 || blk >= dp->size / sb[dp->dev].blocksize)
+    return 0;
+  return ext2_ops.bread(dp->dev, ext2_iops.bmap(dp, blk));
+}
+
+// Walk the index of dp down to the leaf for name.  Fills one
+// frame per level and returns the number of frames, with the
+// name's hash and the hash version in *hashp and *versionp;
+// returns -1 if the index is not one this code understands.
+static int
+dx_probe(struct inode *dp, char *name, int namelen, struct dx_frame *frame,
+         uint32 *hashp, int *versionp)
+{
+  struct superblock *s = &sb[dp->dev];
+  struct dx_root_info *info;
+  struct dx_entry *entries, *p, *q, *m;
+  struct buf *bh;
+  uint32 hash;
+  int version, level, levels, count;
+
+  bh = ext2_ops.bread(dp->dev, ext2_iops.bmap(dp, 0));
+  info = (struct dx_root_info *)(bh->data + DX_ROOT_INFO);
+  version = info->hash_version;
+  levels = info->indirect_levels;
+  entries = (struct dx_entry *)((char *)info + info->info_length);
+  if (info->reserved_zero || info->info_length != sizeof(*info) ||
+      version > DX_HASH_TEA || levels >= DX_MAXLEVELS ||
+      dx_countlimit(entries)->limit != dx_root_limit(s->blocksize)) {
+    ext2_ops.brelse(bh);
+    return -1;
+  }
+  if (EXT2_SB(s)->s_es->s_flags & EXT2_FLAGS_UNSIGNED_HASH)
+    version += DX_HASH_LEGACY_UNSIGNED;
+  hash = dx_hash(s, version, name, namelen);
+
+  for (level = 0; ; level++) {
+    count = dx_countlimit(entries)->count;
+    if (count == 0 || count > dx_countlimit(entries)->limit) {
+      frame[level].bh = bh;
+      dx_release(frame, level + 1);
+      return -1;
+    }
+    // The last entry whose hash is <= hash; entry 0 covers all
+    // hashes below entry 1.
+    p = entries + 1;
+    q = entries + count - 1;
+    while (p <= q) {
+      m = p + (q - p) / 2;
+      if (m->hash > hash)
+        q = m - 1;
+      else
+        p = m + 1;
+    }
+    frame[level].bh = bh;
+    frame[level].entries = entries;
+    frame[level].at = p - 1;
+    if (level == levels)
+      break;
+    if ((bh = dx_bread(dp, frame[level].at->block)) == 0) {
+      dx_release(frame, level + 1);
+      return -1;
+    }
+    entries = (struct dx_entry *)(bh->data + DX_NODE_HDR);
+    if (dx_countlimit(entries)->limit != dx_node_limit(s->blocksize)) {
+      frame[level + 1].bh = bh;
+      dx_release(frame, level + 2);
+      return -1;
+    }
+  }
+  *hashp = hash;
+  *versionp = version;
+  return levels + 1;
+}
+
+// Step the frames to the next leaf if it continues the run of
+// names hashing to hash.  Returns 1 if it did.
+static int
+dx_next(struct inode *dp, uint32 hash, struct dx_frame *frame, int n)
+{
+  struct dx_frame *p;
+  struct buf *bh;
+
+  for (p = frame + n - 1;
+       p->at + 1 >= p->entries + dx_countlimit(p->entries)->count; p--) {
+    if (p == frame)
+      return 0;
+  }
+  if (((p->at + 1)->hash & ~1) != hash)
+    return 0;
+  p->at++;
+  for (; p < frame + n - 1; p++) {
+    if ((bh = dx_bread(dp, p->at->block)) == 0)
+      return 0;
+    ext2_ops.brelse(p[1].bh);
+    p[1].bh = bh;
+    p[1].entries = (struct dx_entry *)(bh->data + DX_NODE_HDR);
+    p[1].at = p[1].entries;
+  }
+  return 1;
+}
+
+// Look name up through the index.  Returns 1 and sets *poff and
+// *inum if found, 0 if not, -1 if the index cannot be used.
+static int
+dx_find(struct inode *dp, char *name, uint *poff, uint *inum)
+{
+  struct dx_frame frame[DX_MAXLEVELS];
+  struct ext2_dir_entry_2 *de;
+  struct buf *bh;
+  uint bs = sb[dp->dev].blocksize;
+  uint32 hash;
+  uint blk;
+  char *end;
+  int namelen = strlen(name);
+  int n, version;
+
+  // "." and ".." live in block 0, in front of the index.
+  if (name[0] == '.' && (namelen == 1 || (namelen == 2 && name[1] == '.')))
+    return -1;
+  if ((n = dx_probe(dp, name, namelen, frame, &hash, &version)) < 0)
+    return -1;
+
+  do {
+    blk = frame[n - 1].at->block;
+    if ((bh = dx_bread(dp, blk)) == 0)
+      break;
+    de = (struct ext2_dir_entry_2 *)bh->data;
+    end = (char *)bh->data + bs;
+    while ((char *)de + EXT2_DIR_REC_LEN(0) <= end && de->rec_len >= EXT2_DIR_REC_LEN(0)) {
+      if (de->inode && de->name_len == namelen &&
+          strncmp(name, de->name, namelen) == 0) {
+        *poff = blk * bs + ((char *)de - (char *)bh->data);
+        *inum = de->inode;
+        ext2_ops.brelse(bh);
+        dx_release(frame, n);
+        return 1;
+      }
+      de = (struct ext2_dir_entry_2 *)((char *)de + de->rec_len);
+    }
+    ext2_ops.brelse(bh);
+  } while (dx_next(dp, hash, frame, n));
+
+  dx_release(frame, n);
+  return 0;
+}
+
+static void
+ext2_set_dirent(struct ext2_dir_entry_2 *de, char *name, int namelen,
+                uint inum, uint type)
+{
+  de->name_len = namelen;
+  strncpy(de->name, name, namelen);
+  de->inode = inum;
+
+  // Translate the xv6 to inode type type
+  if (type == T_DIR) {
+    de->file_type = EXT2_FT_DIR;
+  } else if (type == T_FILE) {
+    de->file_type = EXT2_FT_REG_FILE;
+  } else {
+    // We did not treat char and block devices with difference.
+    panic("ext2: invalid inode mode");
+  }
+}
+
+// Add the entry to leaf block data if it has room.
+static int
+dx_leaf_add(uint bs, char *data, char *name, int namelen, uint inum, uint type)
+{
+  struct ext2_dir_entry_2 *de, *de1;
+  uint reclen = EXT2_DIR_REC_LEN(namelen);
+  uint used;
+
+  for (de = (struct ext2_dir_entry_2 *)data; (char *)de < data + bs;
+       de = (struct ext2_dir_entry_2 *)((char *)de + de->rec_len)) {
+    if (de->rec_len < EXT2_DIR_REC_LEN(0))
+      return -1;
+    used = de->inode ? EXT2_DIR_REC_LEN(de->name_len) : 0;
+    if (de->rec_len >= used + reclen) {
+      if (used) {
+        de1 = (struct ext2_dir_entry_2 *)((char *)de + used);
+        de1->rec_len = de->rec_len - used;
+        de->rec_len = used;
+        de = de1;
+      }
+      ext2_set_dirent(de, name, namelen, inum, type);
+      return 0;
+    }
+  }
+  return -1;
+}
+
+// Append a block to directory dp.
+static struct buf *
+dx_append(struct inode *dp, uint *blk)
+{
+  uint bs = sb[dp->dev].blocksize;
+  struct buf *bh;
+
+  *blk = dp->size / bs;
+  bh = ext2_ops.bread(dp->dev, ext2_iops.bmap(dp, *blk));
+  dp->size += bs;
+  memset(bh->data, 0, bs);
+  return bh;
+}
+
+// Insert an index entry for block blk after frame->at.
+static void
+dx_insert(struct dx_frame *frame, uint32 hash, uint blk)
+{
+  struct dx_countlimit *cl = dx_countlimit(frame->entries);
+  struct dx_entry *e = frame->at + 1;
+
+  memmove(e + 1, e, (frame->entries + cl->count - e) * sizeof(*e));
+  e->hash = hash;
+  e->block = blk;
+  cl->count++;
+}
+
+// Make room for one more entry in the lowest index level.
+// A full root moves its entries into a new node below it; a
+// full node is split in two.
+static int
+dx_grow(struct inode *dp, struct dx_frame *frame, int *np)
+{
+  uint bs = sb[dp->dev].blocksize;
+  struct dx_frame *f = &frame[*np - 1];
+  struct dx_root_info *info;
+  struct dx_entry *entries;
+  struct ext2_dir_entry_2 *de;
+  struct buf *bh;
+  uint blk, count, half;
+  uint32 hash;
+
+  count = dx_countlimit(f->entries)->count;
+  if (count < dx_countlimit(f->entries)->limit)
+    return 0;
+
+  if (*np == 1) {
+    bh = dx_append(dp, &blk);
+    de = (struct ext2_dir_entry_2 *)bh->data;
+    de->rec_len = bs;
+    entries = (struct dx_entry *)(bh->data + DX_NODE_HDR);
+    memmove(entries, f->entries, count * sizeof(*entries));
+    dx_countlimit(entries)->limit = dx_node_limit(bs);
+    dx_countlimit(f->entries)->count = 1;
+    f->entries[0].block = blk;
+    info = (struct dx_root_info *)(f->bh->data + DX_ROOT_INFO);
+    info->indirect_levels = 1;
+    frame[1].bh = bh;
+    frame[1].entries = entries;
+    frame[1].at = entries + (f->at - f->entries);
+    f->at = f->entries;
+    ext2_ops.bwrite(f->bh);
+    ext2_ops.bwrite(bh);
+    *np = 2;
+    return 0;
+  }
+
+  if (dx_countlimit(frame[0].entries)->count >=
+      dx_countlimit(frame[0].entries)->limit) {
+    cprintf("ext2: directory index of inode %d full\n", dp->inum);
+    return -1;
+  }
+  half = count / 2;
+  hash = f->entries[half].hash;
+  bh = dx_append(dp, &blk);
+  de = (struct ext2_dir_entry_2 *)bh->data;
+  de->rec_len = bs;
+  entries = (struct dx_entry *)(bh->data + DX_NODE_HDR);
+  memmove(entries, f->entries + half, (count - half) * sizeof(*entries));
+  dx_countlimit(entries)->limit = dx_node_limit(bs);
+  dx_countlimit(entries)->count = count - half;
+  dx_countlimit(f->entries)->count = half;
+  dx_insert(&frame[0], hash, blk);
+  ext2_ops.bwrite(frame[0].bh);
+  ext2_ops.bwrite(f->bh);
+  ext2_ops.bwrite(bh);
+  if (f->at - f->entries >= half) {
+    ext2_ops.brelse(f->bh);
+    f->at = entries + (f->at - f->entries - half);
+    f->bh = bh;
+    f->entries = entries;
+    frame[0].at++;
+  } else {
+    ext2_ops.brelse(bh);
+  }
+  return 0;
+}
+
+struct dx_map {
+  uint32 hash;
+  ushort offs;
+  ushort size;
+};
+
+// Split the full leaf in bh, moving the upper half of its
+// entries by hash to a new block, and index the new block in
+// f.  Returns the buffer of the leaf that now covers hash and
+// releases the other.
+static struct buf *
+dx_split(struct inode *dp, struct dx_frame *f, struct buf *bh, uint32 hash,
+         int version)
+{
+  struct superblock *s = &sb[dp->dev];
+  uint bs = s->blocksize;
+  struct ext2_dir_entry_2 *de, *de2, *last;
+  struct dx_map *map, t;
+  struct buf *bh2;
+  char *data;
+  uint blk, size, move, split, count, i, j;
+  uint32 hash2;
+  int continued;
+
+  if ((map = (struct dx_map *)kalloc()) == 0) {
+    ext2_ops.brelse(bh);
+    return 0;
+  }
+
+  // Sort the live entries by hash.
+  data = (char *)bh->data;
+  count = 0;
+  for (de = (struct ext2_dir_entry_2 *)data; (char *)de < data + bs;
+       de = (struct ext2_dir_entry_2 *)((char *)de + de->rec_len)) {
+    if (de->rec_len < EXT2_DIR_REC_LEN(0)) {
+      count = 0;
+      break;
+    }
+    if (!de->inode)
+      continue;
+    map[count].hash = dx_hash(s, version, de->name, de->name_len);
+    map[count].offs = (char *)de - data;
+    map[count].size = EXT2_DIR_REC_LEN(de->name_len);
+    for (i = count++; i > 0 && map[i-1].hash > map[i].hash; i--) {
+      t = map[i];
+      map[i] = map[i-1];
+      map[i-1] = t;
+    }
+  }
+  if (count < 2) {
+    kfree((char *)map);
+    ext2_ops.brelse(bh);
+    return 0;
+  }
+
+  // Move the upper half of the block, size-wise.
+  size = 0;
+  move = 0;
+  for (i = count; i-- > 1;) {
+    if (size + map[i].size/2 > bs/2)
+      break;
+    size += map[i].size;
+    move++;
+  }
+  if (move == 0)
+    move = 1;
+  split = count - move;
+  hash2 = map[split].hash;
+  continued = hash2 == map[split - 1].hash;
+
+  bh2 = dx_append(dp, &blk);
+  de2 = last = (struct ext2_dir_entry_2 *)bh2->data;
+  for (i = split; i < count; i++) {
+    de = (struct ext2_dir_entry_2 *)(data + map[i].offs);
+    last = de2;
+    memmove(de2, de, map[i].size);
+    de2->rec_len = map[i].size;
+    de2 = (struct ext2_dir_entry_2 *)((char *)de2 + map[i].size);
+    de->inode = 0;
+  }
+  last->rec_len += bs - ((char *)de2 - (char *)bh2->data);
+
+  // Pack what stays behind to the front of the old block.
+  de2 = last = (struct ext2_dir_entry_2 *)data;
+  for (i = 0; i < bs; i += j) {
+    de = (struct ext2_dir_entry_2 *)(data + i);
+    j = de->rec_len;
+    if (!de->inode)
+      continue;
+    size = EXT2_DIR_REC_LEN(de->name_len);
+    if (de != de2)
+      memmove(de2, de, size);
+    de2->rec_len = size;
+    last = de2;
+    de2 = (struct ext2_dir_entry_2 *)((char *)de2 + size);
+  }
+  last->rec_len += bs - ((char *)de2 - data);
+  kfree((char *)map);
+
+  dx_insert(f, hash2 + continued, blk);
+  ext2_ops.bwrite(f->bh);
+  ext2_ops.bwrite(bh);
+  ext2_ops.bwrite(bh2);
+  if (hash >= hash2) {
+    ext2_ops.brelse(bh);
+    return bh2;
+  }
+  ext2_ops.brelse(bh2);
+  return bh;
+}
+
+// Add an entry to indexed directory dp.  Returns -2 if the
+// index cannot be used, including when it is full or the leaf
+// cannot be split to make room, so that the caller can fall
+// back to a linear insert.
+static int
+dx_add(struct inode *dp, char *name, uint inum, uint type)
+{
+  struct dx_frame frame[DX_MAXLEVELS];
+  uint bs = sb[dp->dev].blocksize;
+  int namelen = strlen(name);
+  struct buf *bh;
+  uint32 hash;
+  int n, r, version;
+
+  if ((n = dx_probe(dp, name, namelen, frame, &hash, &version)) < 0)
+    return -2;
+  if ((bh = dx_bread(dp, frame[n - 1].at->block)) == 0) {
+    dx_release(frame, n);
+    return -2;
+  }
+  r = -2;
+  if (dx_leaf_add(bs, (char *)bh->data, name, namelen, inum, type) == 0) {
+    r = 0;
+  } else if (dx_grow(dp, frame, &n) < 0) {
+    ext2_ops.brelse(bh);
+    bh = 0;
+  } else if ((bh = dx_split(dp, &frame[n - 1], bh, hash, version)) != 0) {
+    if (dx_leaf_add(bs, (char *)bh->data, name, namelen, inum, type) == 0)
+      r = 0;
+  }
+  if (bh) {
+    if (r == 0)
+      ext2_ops.bwrite(bh);
+    ext2_ops.brelse(bh);
+  }
+  dx_release(frame, n);
+  ext2_iops.iupdate(dp);
+  return r;
+}
+
+// Turn the one-block directory dp into an indexed one: move
+// everything behind ".." into a new leaf and put the index
+// root in its place, then add the new entry.
+static int
+dx_make(struct inode *dp, char *name, uint inum, uint type)
+{
+  struct ext2_inode_info *ei = dp->i_private;
+  struct ext2_superblock *es = EXT2_SB(&sb[dp->dev])->s_es;
+  uint bs = sb[dp->dev].blocksize;
+  struct ext2_dir_entry_2 *dot, *dotdot, *de, *de2, *last;
+  struct dx_root_info *info;
+  struct dx_entry *entries;
+  struct buf *bh, *bh2;
+  uint blk, size;
+  char *data;
+  int r;
+
+  bh = ext2_ops.bread(dp->dev, ext2_iops.bmap(dp, 0));
+  data = (char *)bh->data;
+  dot = (struct ext2_dir_entry_2 *)data;
+  dotdot = (struct ext2_dir_entry_2 *)(data + dot->rec_len);
+  if (dot->rec_len != EXT2_DIR_REC_LEN(1) || dot->name_len != 1 ||
+      dotdot->name_len != 2 || dotdot->name[0] != '.' || dotdot->name[1] != '.' ||
+      dotdot->rec_len < EXT2_DIR_REC_LEN(2)) {
+    ext2_ops.brelse(bh);
+    return -2;
+  }
+
+  bh2 = dx_append(dp, &blk);
+  de2 = last = (struct ext2_dir_entry_2 *)bh2->data;
+  for (de = (struct ext2_dir_entry_2 *)((char *)dotdot + dotdot->rec_len);
+       (char *)de < data + bs;
+       de = (struct ext2_dir_entry_2 *)((char *)de + de->rec_len)) {
+    if (de->rec_len < EXT2_DIR_REC_LEN(0))
+      break;
+    if (!de->inode)
+      continue;
+    size = EXT2_DIR_REC_LEN(de->name_len);
+    memmove(de2, de, size);
+    de2->rec_len = size;
+    last = de2;
+    de2 = (struct ext2_dir_entry_2 *)((char *)de2 + size);
+  }
+  last->rec_len += bs - ((char *)de2 - (char *)bh2->data);
+  ext2_ops.bwrite(bh2);
+  ext2_ops.brelse(bh2);
+
+  dotdot->rec_len = bs - EXT2_DIR_REC_LEN(1);
+  info = (struct dx_root_info *)(data + DX_ROOT_INFO);
+  memset(info, 0, bs - DX_ROOT_INFO);
+  info->hash_version = es->s_def_hash_version;
+  if (info->hash_version > DX_HASH_TEA)
+    info->hash_version = DX_HASH_HALF_MD4;
+  info->info_length = sizeof(*info);
+  entries = (struct dx_entry *)(info + 1);
+  dx_countlimit(entries)->limit = dx_root_limit(bs);
+  dx_countlimit(entries)->count = 1;
+  entries[0].block = blk;
+  ext2_ops.bwrite(bh);
+  ext2_ops.brelse(bh);
+
+  ei->i_ei.i_flags |= EXT2_INDEX_FL;
+  ext2_iops.iupdate(dp);
+  if ((r = dx_add(dp, name, inum, type)) == -2) {
+    ei->i_ei.i_flags &= ~EXT2_INDEX_FL;
+    ext2_iops.iupdate(dp);
+  }
+  return r;
+}
+
 struct inode*
 ext2_dirlookup(struct inode *dp, char *name, uint *poff)
 {
@@ -537,6 +1425,17 @@ ext2_dirlookup(struct inode *dp, char *name, uint *poff)
   struct buf *bh;
   int namelen = strlen(name);
 
+  if (is_dx(dp)) {
+    switch (dx_find(dp, name, &off, &inum)) {
+    case 0:
+      return 0;
+    case 1:
+      if(poff)
+        *poff = off;
+      return ext2_iget(dp->dev, inum);
+    }
+  }
+
   for (off = 0; off < dp->size;) {
     currblk = off / sb[dp->dev].blocksize;
 
@@ -576,6 +1475,7 @@ ext2_iupdate(struct inode *ip)
   raw_inode = ext2_get_inode(&sb[ip->dev], ip->inum, &bp);
 
   raw_inode->i_mode = ei->i_ei.i_mode;
+  raw_inode->i_flags = ei->i_ei.i_flags;
   raw_inode->i_blocks = ei->i_ei.i_blocks;
   raw_inode->i_links_count = ip->nlink;
   memmove(raw_inode->i_block, ei->i_ei.i_block, sizeof(ei->i_ei.i_block));
@@ -583,6 +1483,12 @@ ext2_iupdate(struct inode *ip)
 
   ext2_ops.bwrite(bp);
   ext2_ops.brelse(bp);
+
+  // iput() writes a deleted inode back with type 0.  As on s5,
+  // that is the point where it becomes free, so the inode is
+  // not written after another ialloc() may have taken it.
+  if (ip->type == 0 && ip->nlink == 0)
+    ext2_free_inode(ip);
 }
 
 /**
@@ -656,6 +1562,7 @@ do_more:
 
   ext2_ops.bwrite(bitmap_bh);
   group_adjust_blocks(superb, block_group, desc, bh2, group_freed);
+  ext2_gsum_scan(superb, block_group, bitmap_bh);
   freed += group_freed;
 
   if (overflow) {
@@ -841,6 +1748,8 @@ ext2_itrunc(struct inode *ip)
   struct ext2_inode_info *ei = ip->i_private;
 
   i_data = ei->i_ei.i_block;
+  ei->i_nextent = 0;
+  ext2_rsv_drop(&sb[ip->dev], ip->inum);
 
   if (n == 0)
     return;
@@ -879,16 +1788,18 @@ ext2_itrunc(struct inode *ip)
       ;
   }
 
-  // unlock the inode here
-  ext2_free_inode(ip);
-
+  // The inode itself is freed by ext2_iupdate() once iput()
+  // has written it back with type 0.
   ext2_iops.iupdate(ip);
 }
 
 void
 ext2_cleanup(struct inode *ip)
 {
+  ext2_rsv_drop(&sb[ip->dev], ip->inum);
   memset(ip->i_private, 0, sizeof(struct ext2_inode_info));
+  kmem_cache_free(&ext2_ei_cache, ip->i_private);
+  ip->i_private = 0;
 }
 
 /**
@@ -963,40 +1874,6 @@ ext2_block_to_path(struct inode *inode,
   return n;
 }
 
-static void
-ext2_update_branch(struct inode *inode, uint bn, Indirect *chain)
-{
-  int ptrs = EXT2_ADDR_PER_BLOCK(&sb[inode->dev]);
-  int ptrs_bits = EXT2_ADDR_PER_BLOCK_BITS(&sb[inode->dev]);
-  const long direct_blocks = EXT2_NDIR_BLOCKS,
-        indirect_blocks = ptrs,
-        double_blocks = (1 << (ptrs_bits * 2));
-  struct ext2_inode_info *ei;
-
-  ei = inode->i_private;
-
-  // Update inode block
-  if (bn < 0) {
-    panic("block_to_path invalid block num");
-  } else if (bn < direct_blocks) {
-    if (ei->i_ei.i_block[bn] == 0)
-      ei->i_ei.i_block[bn] = chain[0].key;
-  } else if ((bn -= direct_blocks) < indirect_blocks) {
-    if (ei->i_ei.i_block[EXT2_IND_BLOCK] == 0)
-      ei->i_ei.i_block[EXT2_IND_BLOCK] = chain[0].key;
-  } else if ((bn -= indirect_blocks) < double_blocks) {
-    if (ei->i_ei.i_block[EXT2_DIND_BLOCK] == 0)
-      ei->i_ei.i_block[EXT2_DIND_BLOCK] = chain[0].key;
-  } else if (((bn -= double_blocks) >> (ptrs_bits * 2)) < ptrs) {
-    if (ei->i_ei.i_block[EXT2_TIND_BLOCK] == 0)
-      ei->i_ei.i_block[EXT2_TIND_BLOCK] = chain[0].key;
-  } else {
-    panic("This block is out of bounds from this ext2 fs");
-  }
-
-  return;
-}
-
 /**
  * ext2_get_branch - read the chain of indirect blocks leading to data
  * @inode: inode in question
@@ -1249,6 +2126,126 @@ find_next_usable_block(int start, struct buf *bh, int maxblocks)
   return here;
 }
 
+// Where the window of file inum starts, if it has one.
+static int
+ext2_rsv_get(struct superblock *sb, uint inum, ext2_fsblk_t *start)
+{
+  struct ext2_rsv *w;
+  int found = 0;
+
+  acquire(&rsvtab[sb->minor].lock);
+  for (w = rsvtab[sb->minor].w; w < &rsvtab[sb->minor].w[EXT2_NRSV]; w++) {
+    if (w->inum == inum && w->start < w->end) {
+      *start = w->start;
+      found = 1;
+      break;
+    }
+  }
+  release(&rsvtab[sb->minor].lock);
+  return found;
+}
+
+// Give file inum the window [start, end), or drop its window
+// if that is empty.
+static void
+ext2_rsv_set(struct superblock *sb, uint inum, ext2_fsblk_t start, ext2_fsblk_t end)
+{
+  struct ext2_rsv *w, *slot;
+
+  acquire(&rsvtab[sb->minor].lock);
+  slot = 0;
+  for (w = rsvtab[sb->minor].w; w < &rsvtab[sb->minor].w[EXT2_NRSV]; w++) {
+    if (w->inum == inum) {
+      slot = w;
+      break;
+    }
+    if (slot == 0 || (slot->inum && (!w->inum || w->stamp < slot->stamp)))
+      slot = w;
+  }
+  if (start < end) {
+    slot->inum = inum;
+    slot->start = start;
+    slot->end = end;
+    slot->stamp = ++rsvtab[sb->minor].clock;
+  } else if (slot->inum == inum) {
+    slot->inum = 0;
+  }
+  release(&rsvtab[sb->minor].lock);
+}
+
+static void
+ext2_rsv_drop(struct superblock *sb, uint inum)
+{
+  ext2_rsv_set(sb, inum, 0, 0);
+}
+
+// If group block grp_blk lies in a window that is not inum's,
+// return the window's end, relative to the group.  Otherwise
+// return 0 and lower *limit to where the next such window
+// starts.
+static ext2_grpblk_t
+ext2_rsv_clip(struct superblock *sb, uint inum, ext2_fsblk_t first,
+              ext2_grpblk_t grp_blk, ext2_grpblk_t *limit)
+{
+  struct ext2_rsv *w;
+  ext2_fsblk_t b = first + grp_blk;
+  ext2_grpblk_t skip = 0;
+
+  acquire(&rsvtab[sb->minor].lock);
+  for (w = rsvtab[sb->minor].w; w < &rsvtab[sb->minor].w[EXT2_NRSV]; w++) {
+    if (w->inum == 0 || w->inum == inum || w->start >= w->end)
+      continue;
+    if (b >= w->start && b < w->end) {
+      skip = w->end - first;
+      break;
+    }
+    if (w->start > b && w->start - first < *limit)
+      *limit = w->start - first;
+  }
+  release(&rsvtab[sb->minor].lock);
+  return skip;
+}
+
+// Recount the free blocks and the longest free run of a group
+// from its bitmap, which the caller holds.
+static void
+ext2_gsum_scan(struct superblock *sb, int group, struct buf *bh)
+{
+  unsigned long *map = (unsigned long *)bh->data;
+  struct ext2_group_sum *gs;
+  ext2_grpblk_t b, e, end, free, maxrun;
+
+  if (group >= EXT2_MAX_GSUM)
+    return;
+  gs = &EXT2_SB(sb)->s_gsum[group];
+  end = EXT2_BLOCKS_PER_GROUP(sb);
+  free = end - bitmap_weight(map, end);
+  maxrun = 0;
+  for (b = find_next_zero_bit(map, end, 0); b < end && end - b > maxrun;
+       b = find_next_zero_bit(map, end, e)) {
+    e = find_next_bit(map, end, b);
+    if (e - b > maxrun)
+      maxrun = e - b;
+  }
+  gs->free = free;
+  gs->maxrun = maxrun;
+}
+
+// Might group have a free run of len blocks?  Groups whose
+// bitmap has not been seen yet might.
+static int
+ext2_gsum_fits(struct superblock *sb, int group, ext2_grpblk_t len)
+{
+  struct ext2_group_sum *gs;
+
+  if (group >= EXT2_MAX_GSUM)
+    return 1;
+  gs = &EXT2_SB(sb)->s_gsum[group];
+  if (gs->free == 0)
+    return 0;
+  return gs->maxrun == EXT2_GSUM_UNKNOWN || gs->maxrun >= len;
+}
+
 /**
  * ext2_try_to_allocate()
  * @sb:   superblock
@@ -1270,13 +2267,18 @@ find_next_usable_block(int start, struct buf *bh, int maxblocks)
  *
  * If we failed to allocate the desired block then we may end up crossing to a
  * new bitmap.
+ *
+ * Blocks in other files' reservation windows are skipped.  For a file
+ * (@inum not 0), *@rsv_end is set to the end of the free blocks right
+ * behind the allocated run, which become the file's new window.
  */
 static int
 ext2_try_to_allocate(struct superblock *sb, int group,
     struct buf *bitmap_bh, ext2_grpblk_t grp_goal,
-    unsigned long *count)
+    unsigned long *count, uint inum, ext2_grpblk_t *rsv_end)
 {
-  ext2_grpblk_t start, end;
+  ext2_grpblk_t start, end, limit, skip;
+  ext2_fsblk_t first = ext2_group_first_block_no(sb, group);
   unsigned long num = 0;
 
   if (grp_goal > 0)
@@ -1286,6 +2288,11 @@ ext2_try_to_allocate(struct superblock *sb, int group,
   end = EXT2_BLOCKS_PER_GROUP(sb);
 
 repeat:
+  if (grp_goal < 0 && *count > 1) {
+    grp_goal = find_zero_run((unsigned long *)bitmap_bh->data, end, start, *count);
+    if (grp_goal >= end)
+      grp_goal = -1;
+  }
   if (grp_goal < 0) {
     grp_goal = find_next_usable_block(start, bitmap_bh, end);
     if (grp_goal < 0)
@@ -1300,25 +2307,42 @@ repeat:
   }
   start = grp_goal;
 
+  limit = end;
+  if ((skip = ext2_rsv_clip(sb, inum, first, grp_goal, &limit)) > 0) {
+    start = skip;
+    grp_goal = -1;
+    if (start >= end)
+      goto fail_access;
+    goto repeat;
+  }
+
   if (ext2_set_bit_atomic(grp_goal,
                           (unsigned long *)bitmap_bh->data)) {
     /*
      * The block was allocated by another thread, or it was
-     * allocated and then freed by another thread
+     * allocated and then freed by another thread; search on
+     * from the next one.
      */
     start++;
-    grp_goal++;
+    grp_goal = -1;
     if (start >= end)
       goto fail_access;
     goto repeat;
   }
   num++;
   grp_goal++;
-  while (num < *count && grp_goal < end &&
+  while (num < *count && grp_goal < limit &&
          !ext2_set_bit_atomic(grp_goal, (unsigned long*)bitmap_bh->data)) {
     num++;
     grp_goal++;
   }
+  if (inum) {
+    for (*rsv_end = grp_goal; *rsv_end < limit &&
+         *rsv_end < grp_goal + EXT2_RSVBLOCKS &&
+         !ext2_test_bit(*rsv_end, (unsigned long *)bitmap_bh->data);
+         (*rsv_end)++)
+      ;
+  }
   *count = num;
   return grp_goal - num;
 fail_access:
@@ -1375,6 +2399,9 @@ ext2_new_blocks(struct inode *inode, ext2_fsblk_t goal,
   struct ext2_sb_info *sbi;
   unsigned long ngroups;
   unsigned long num = *count;
+  uint inum;
+  ext2_grpblk_t rsv_end = 0;
+  int pass;
 
   *errp = -1;
   superb = &sb[inode->dev];
@@ -1382,6 +2409,11 @@ ext2_new_blocks(struct inode *inode, ext2_fsblk_t goal,
   sbi = EXT2_SB(superb);
   es = sbi->s_es;
 
+  // Regular files allocate from their reservation window.
+  inum = inode->type == T_FILE ? inode->inum : 0;
+  if (inum)
+    ext2_rsv_get(superb, inum, &goal);
+
   /* if (!ext2_has_free_blocks(sbi)) { */
   /*   *errp = -ENOSPC; */
   /*   goto out; */
@@ -1403,14 +2435,20 @@ retry_alloc:
 
   free_blocks = gdp->bg_free_blocks_count;
 
-  if (free_blocks > 0) {
+  // Stay near the goal if the group can take the whole run, as
+  // far as its summary knows.
+  if (free_blocks > 0 && ext2_gsum_fits(superb, group_no, num)) {
     grp_target_blk = ((goal - es->s_first_data_block) %
                       EXT2_BLOCKS_PER_GROUP(superb));
+    if (bitmap_bh)
+      ext2_ops.brelse(bitmap_bh);
     bitmap_bh = read_block_bitmap(superb, group_no);
     if (!bitmap_bh)
       goto io_error;
     grp_alloc_blk = ext2_try_to_allocate(superb, group_no,
-                                         bitmap_bh, grp_target_blk, &num);
+                                         bitmap_bh, grp_target_blk, &num,
+                                         inum, &rsv_end);
+    ext2_gsum_scan(superb, group_no, bitmap_bh);
     if (grp_alloc_blk >= 0)
       goto allocated;
   }
@@ -1420,34 +2458,44 @@ retry_alloc:
   /*
    * Now search the rest of the groups.  We assume that
    * group_no and gdp correctly point to the last group visited.
+   * The first pass only reads the bitmaps of groups that may have
+   * a free run of the whole size, the second takes any free block.
    */
-  for (bgi = 0; bgi < ngroups; bgi++) {
-    group_no++;
-    if (group_no >= ngroups)
-      group_no = 0;
-    gdp = ext2_get_group_desc(superb, group_no, &gdp_bh);
-    if (!gdp)
-      goto io_error;
+  for (pass = 0; pass < 2; pass++) {
+    for (bgi = 0; bgi < ngroups; bgi++) {
+      group_no++;
+      if (group_no >= ngroups)
+        group_no = 0;
+      if (!ext2_gsum_fits(superb, group_no, pass == 0 ? num : 1))
+        continue;
+      gdp = ext2_get_group_desc(superb, group_no, &gdp_bh);
+      if (!gdp)
+        goto io_error;
 
-    free_blocks = gdp->bg_free_blocks_count;
-    /*
-     * skip this group (and avoid loading bitmap) if there
-     * are no free blocks
-     */
-    if (!free_blocks)
-      continue;
+      free_blocks = gdp->bg_free_blocks_count;
+      /*
+       * skip this group (and avoid loading bitmap) if there
+       * are no free blocks
+       */
+      if (!free_blocks)
+        continue;
 
-    ext2_ops.brelse(bitmap_bh);
-    bitmap_bh = read_block_bitmap(superb, group_no);
-    if (!bitmap_bh)
-      goto io_error;
-    /*
-     * try to allocate block(s) from this group, without a goal(-1).
-     */
-    grp_alloc_blk = ext2_try_to_allocate(superb, group_no,
-                                         bitmap_bh, -1, &num);
-    if (grp_alloc_blk >= 0)
-      goto allocated;
+      if (bitmap_bh)
+        ext2_ops.brelse(bitmap_bh);
+      bitmap_bh = read_block_bitmap(superb, group_no);
+      if (!bitmap_bh)
+        goto io_error;
+      /*
+       * try to allocate block(s) from this group, without a goal(-1).
+       */
+      num = *count;
+      grp_alloc_blk = ext2_try_to_allocate(superb, group_no,
+                                           bitmap_bh, -1, &num,
+                                           inum, &rsv_end);
+      ext2_gsum_scan(superb, group_no, bitmap_bh);
+      if (grp_alloc_blk >= 0)
+        goto allocated;
+    }
   }
 
   goto out;
@@ -1470,16 +2518,15 @@ allocated:
   }
 
   group_adjust_blocks(superb, group_no, gdp, gdp_bh, -num);
+  if (inum)
+    ext2_rsv_set(superb, inum, ret_block + num,
+                 rsv_end + ext2_group_first_block_no(superb, group_no));
 
   ext2_ops.bwrite(bitmap_bh);
 
   *errp = 0;
   ext2_ops.brelse(bitmap_bh);
-  /* if (num < *count) { */
-  /*   dquot_free_block_nodirty(inode, *count-num); */
-  /*   mark_inode_dirty(inode); */
-  /*   *count = num; */
-  /* } */
+  *count = num;
   return ret_block;
 
 io_error:
@@ -1492,7 +2539,8 @@ out:
   /*   dquot_free_block_nodirty(inode, *count); */
   /*   mark_inode_dirty(inode); */
   /* } */
-  ext2_ops.brelse(bitmap_bh);
+  if (bitmap_bh)
+    ext2_ops.brelse(bitmap_bh);
   return 0;
 }
 
@@ -1639,10 +2687,132 @@ failed:
   return err;
 }
 
-uint
-ext2_bmap(struct inode *ip, uint bn)
+static struct {
+  uint hits;
+  uint misses;
+} extcache;  // Statistics only; counted without a lock.
+
+void
+ext2stat(struct iostat *st)
+{
+  st->ehits = extcache.hits;
+  st->emisses = extcache.misses;
+}
+
+// Look bn up in the extent cache of the (locked) inode.
+static int
+ext2_ext_find(struct ext2_inode_info *ei, uint bn, uint *pblk)
+{
+  struct ext2_extent *e;
+  int lo, hi, m;
+
+  lo = 0;
+  hi = ei->i_nextent - 1;
+  while (lo <= hi) {
+    m = (lo + hi) / 2;
+    e = &ei->i_extent[m];
+    if (bn < e->lblk)
+      hi = m - 1;
+    else if (bn - e->lblk >= e->len)
+      lo = m + 1;
+    else {
+      *pblk = e->pblk + (bn - e->lblk);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Remember that the len blocks from lblk on live at pblk on.
+// The run is merged with a neighbour it continues; when the
+// cache is full the shortest extent makes room.
+static void
+ext2_ext_add(struct ext2_inode_info *ei, uint lblk, uint pblk, uint len)
+{
+  struct ext2_extent *e;
+  int i, n, victim;
+
+  n = ei->i_nextent;
+  for (i = 0; i < n && ei->i_extent[i].lblk < lblk; i++)
+    ;
+  if (i < n && lblk + len > ei->i_extent[i].lblk)
+    len = ei->i_extent[i].lblk - lblk;
+  if (len == 0)
+    return;
+
+  if (i > 0) {
+    e = &ei->i_extent[i - 1];
+    if (e->lblk + e->len > lblk)
+      return;
+    if (e->lblk + e->len == lblk && e->pblk + e->len == pblk) {
+      e->len += len;
+      if (i < n && e->lblk + e->len == e[1].lblk &&
+          e->pblk + e->len == e[1].pblk) {
+        e->len += e[1].len;
+        memmove(e + 1, e + 2, (n - i - 1) * sizeof(*e));
+        ei->i_nextent--;
+      }
+      return;
+    }
+  }
+  if (i < n) {
+    e = &ei->i_extent[i];
+    if (lblk + len == e->lblk && pblk + len == e->pblk) {
+      e->lblk = lblk;
+      e->pblk = pblk;
+      e->len += len;
+      return;
+    }
+  }
+
+  if (n == EXT2_NEXTENT) {
+    victim = 0;
+    for (n = 1; n < EXT2_NEXTENT; n++)
+      if (ei->i_extent[n].len < ei->i_extent[victim].len)
+        victim = n;
+    if (victim < i)
+      i--;
+    n = EXT2_NEXTENT - 1;
+    memmove(&ei->i_extent[victim], &ei->i_extent[victim + 1],
+            (n - victim) * sizeof(*e));
+  }
+  memmove(&ei->i_extent[i + 1], &ei->i_extent[i], (n - i) * sizeof(*e));
+  e = &ei->i_extent[i];
+  e->lblk = lblk;
+  e->pblk = pblk;
+  e->len = len;
+  ei->i_nextent = n + 1;
+}
+
+// Hook the branch that ext2_alloc_branch() built into the
+// tree: fill in the pointer that was missing and, when only
+// data blocks were allocated, the pointers to the rest of the
+// run behind it.
+static void
+ext2_splice_branch(struct inode *inode, Indirect *where, int num, int blks)
+{
+  int i;
+
+  *where->p = where->key;
+  if (num == 0)
+    for (i = 1; i < blks; i++)
+      where->p[i] = where->key + i;
+
+  if (where->bh)
+    ext2_ops.bwrite(where->bh);
+  else
+    ext2_iops.iupdate(inode);
+}
+
+// Map up to *count blocks of ip from bn on, allocating the
+// ones that are missing as one run if create is set.  Returns
+// the disk block of bn and sets *count to the number of blocks
+// mapped contiguously from there (at least 1); returns 0 for a
+// hole when create is not set.
+static uint
+ext2_get_blocks(struct inode *ip, uint bn, uint *count, int create)
 {
-  /* struct buf *bp; */
+  struct ext2_inode_info *ei = ip->i_private;
   int depth;
   Indirect chain[4];
   Indirect *partial;
@@ -1651,9 +2821,17 @@ ext2_bmap(struct inode *ip, uint bn)
   uint blkn;
   int blocks_to_boundary;
   ext2_fsblk_t goal;
-  int count;
-  unsigned long maxblocks;
+  int n;
   int err;
+  uint32 *p;
+  uint len;
+
+  if (ext2_ext_find(ei, bn, &blkn)) {
+    extcache.hits++;
+    *count = 1;
+    return blkn;
+  }
+  extcache.misses++;
 
   depth = ext2_block_to_path(ip, bn, offsets, &blocks_to_boundary);
 
@@ -1663,34 +2841,49 @@ ext2_bmap(struct inode *ip, uint bn)
   partial = ext2_get_branch(ip, depth, offsets, chain);
 
   if (!partial) {
+    // Cache the whole run of contiguous blocks that the leaf of
+    // the chain maps from bn on.
+    blkn = chain[depth-1].key;
+    p = chain[depth-1].p;
+    for (len = 1; len <= blocks_to_boundary && p[len] == blkn + len; len++)
+      ;
+    ext2_ext_add(ei, bn, blkn, len);
     goto got_it;
   }
 
-  maxblocks = sb[ip->dev].blocksize >> EXT2_BLOCK_SIZE_BITS(&sb[ip->dev]);
-
   // The requested block is not allocated yet
+  if (!create) {
+    while (partial > chain) {
+      brelse(partial->bh);
+      partial--;
+    }
+    *count = 1;
+    return 0;
+  }
   goal = ext2_find_goal(ip, bn, partial);
 
   /* the number of blocks need to allocate for [d,t]indirect blocks */
   indirect_blks = (chain + depth) - partial - 1;
 
-  indirect_blks = (chain + depth) - partial - 1;
   /*
-   * Next look up the indirect map to count the totoal number of
+   * Next look up the indirect map to count the total number of
    * direct blocks to allocate for this branch.
    */
-  count = ext2_blks_to_allocate(partial, indirect_blks,
-      maxblocks, blocks_to_boundary);
+  n = ext2_blks_to_allocate(partial, indirect_blks,
+      *count, blocks_to_boundary);
 
-  err = ext2_alloc_branch(ip, indirect_blks, &count, goal,
+  err = ext2_alloc_branch(ip, indirect_blks, &n, goal,
       offsets + (partial - chain), partial);
 
   if (err < 0)
     panic("error on ext2_alloc_branch");
+  ext2_splice_branch(ip, partial, indirect_blks, n);
+  len = n;
+  ext2_ext_add(ei, bn, chain[depth-1].key, len);
 
 got_it:
   blkn = chain[depth-1].key;
-  ext2_update_branch(ip, bn, chain);
+  *count = len;
 
   /* Clean up and exit */
   partial = chain + depth - 1;  /* the whole chain */
@@ -1703,6 +2896,22 @@ got_it:
   return blkn;
 }
 
+uint
+ext2_bmap(struct inode *ip, uint bn)
+{
+  uint n = 1;
+
+  return ext2_get_blocks(ip, bn, &n, 1);
+}
+
+uint
+ext2_blookup(struct inode *ip, uint bn)
+{
+  uint n = 1;
+
+  return ext2_get_blocks(ip, bn, &n, 0);
+}
+
 void
 ext2_ilock(struct inode *ip)
 {
@@ -1710,16 +2919,11 @@ ext2_ilock(struct inode *ip)
   struct ext2_inode *raw_inode;
   struct ext2_inode_info *ei;
 
-  ei = ip->i_private;
-
   if(ip == 0 || ip->ref < 1)
     panic("ilock");
 
-  acquire(&icache.lock);
-  while (ip->flags & I_BUSY)
-    sleep(ip, &icache.lock);
-  ip->flags |= I_BUSY;
-  release(&icache.lock);
+  acquiresleep(&ip->lock);
+  ei = ip->i_private;  // set up by iget() under the lock
 
   if (!(ip->flags & I_VALID)) {
     raw_inode = ext2_get_inode(&sb[ip->dev], ip->inum, &bp);
@@ -1736,6 +2940,7 @@ ext2_ilock(struct inode *ip)
     ip->nlink = raw_inode->i_links_count;
     ip->size = raw_inode->i_size;
     memmove(&ei->i_ei, raw_inode, sizeof(ei->i_ei));
+    ei->i_nextent = 0;
 
     ext2_ops.brelse(bp);
     ip->flags |= I_VALID;
@@ -1747,7 +2952,7 @@ ext2_ilock(struct inode *ip)
 int
 ext2_writei(struct inode *ip, char *src, uint off, uint n)
 {
-  uint tot, m;
+  uint tot, m, bn, last, cnt;
   struct buf *bp;
 
   if (ip->type == T_DEV) {
@@ -1761,11 +2966,25 @@ ext2_writei(struct inode *ip, char *src, uint off, uint n)
 
   // TODO: Verify the max file size
 
+  // Map the blocks of the whole write up front so that missing
+  // ones are allocated as runs rather than one at a time; the
+  // bmap() calls below then hit the extent cache.
+  if (n > 0) {
+    last = (off + n - 1) / sb[ip->dev].blocksize;
+    for (bn = off / sb[ip->dev].blocksize; bn <= last; bn += cnt) {
+      cnt = last - bn + 1;
+      ext2_get_blocks(ip, bn, &cnt, 1);
+    }
+  }
+
   for (tot = 0; tot < n; tot += m, off += m, src += m) {
     bp = ext2_ops.bread(ip->dev, ext2_iops.bmap(ip, off / sb[ip->dev].blocksize));
     m = min(n - tot, sb[ip->dev].blocksize - off % sb[ip->dev].blocksize);
     memmove(bp->data + off % sb[ip->dev].blocksize, src, m);
-    ext2_ops.bwrite(bp);
+    if (ip->type == T_DIR)
+      ext2_ops.bwrite(bp);
+    else
+      ext2_bwrite_data(bp);
     ext2_ops.brelse(bp);
   }
 
@@ -1805,12 +3024,33 @@ ext2_dirlink(struct inode *dp, char *name, uint inum, uint type)
   int n;
   int numblocks = (dp->size + chunk_size - 1) / chunk_size;
   char *kaddr;
+  struct inode *ip;
+  struct ext2_inode_info *ei = dp->i_private;
+  int r;
 
-  if (ext2_iops.dirlookup(dp, name, 0) != 0) {
+  if ((ip = ext2_iops.dirlookup(dp, name, 0)) != 0) {
+    iput(ip);
     return -1;
   }
 
+  if (is_dx(dp)) {
+    if ((r = dx_add(dp, name, inum, type)) != -2)
+      return r;
+    // An index we cannot maintain; let e2fsck rebuild it.
+    ei->i_ei.i_flags &= ~EXT2_INDEX_FL;
+    ext2_iops.iupdate(dp);
+    // dx_add may have added blocks before giving up.
+    numblocks = (dp->size + chunk_size - 1) / chunk_size;
+  }
+
   for (n = 0; n <= numblocks; n++) {
+    if (n == 1 && numblocks == 1 &&
+        (EXT2_SB(&sb[dp->dev])->s_es->s_feature_compat & EXT2_FEATURE_COMPAT_DIR_INDEX)) {
+      // The first block is full: index the directory.
+      if ((r = dx_make(dp, name, inum, type)) != -2)
+        return r;
+      numblocks = (dp->size + chunk_size - 1) / chunk_size;
+    }
     bh = ext2_ops.bread(dp->dev, ext2_iops.bmap(dp, n));
     kaddr = (char *) bh->data;
     de = (struct ext2_dir_entry_2 *) kaddr;
@@ -1852,19 +3092,7 @@ got_it:
     de->rec_len = name_len;
     de = de1;
   }
-  de->name_len = namelen;
-  strncpy(de->name, name, namelen);
-  de->inode = inum;
-
-  // Translate the xv6 to inode type type
-  if (type == T_DIR) {
-    de->file_type = EXT2_FT_DIR;
-  } else if (type == T_FILE) {
-    de->file_type = EXT2_FT_REG_FILE;
-  } else {
-    // We did not treat char and block devices with difference.
-    panic("ext2: invalid inode mode");
-  }
+  ext2_set_dirent(de, name, namelen, inum, type);
 
   ext2_ops.bwrite(bh);
   ext2_ops.brelse(bh);
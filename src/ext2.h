@@ -52,6 +52,20 @@ enum {
 /*
  * second extended-fs super-block data in memory
  */
+/*
+ * In-memory summary of a block group's free space, so the
+ * allocator can pass over groups that cannot serve a request
+ * without reading their bitmap.  Rescanned whenever the
+ * allocator or ext2_free_blocks() holds the group's bitmap.
+ */
+#define EXT2_MAX_GSUM      1024    /* Groups with a summary */
+#define EXT2_GSUM_UNKNOWN  0xffff  /* Bitmap not seen yet */
+
+struct ext2_group_sum {
+  uint16 free;    /* Free blocks */
+  uint16 maxrun;  /* Longest run of free blocks */
+};
+
 struct ext2_sb_info {
   unsigned long s_inodes_per_block; /* Number of inodes per block */
   unsigned long s_blocks_per_group; /* Number of blocks in a group */
@@ -74,6 +88,7 @@ struct ext2_sb_info {
   unsigned long s_dir_count;
   uint8 *s_debts;
   int flags;
+  struct ext2_group_sum *s_gsum;    /* EXT2_MAX_GSUM entries, one page */
 };
 
 static inline struct ext2_sb_info *
@@ -170,7 +185,9 @@ struct ext2_superblock {
   uint16 s_reserved_word_pad;
   uint32 s_default_mount_opts;
   uint32 s_first_meta_bg;   /* First metablock block group */
-  uint32 s_reserved[190];  /* Padding to the end of the block */
+  uint32 s_reserved1[22];  /* ext4 fields we do not use */
+  uint32 s_flags;          /* Miscellaneous flags */
+  uint32 s_reserved[167];  /* Padding to the end of the block */
 };
 
 #define EXT2_NDIR_BLOCKS  12
@@ -236,9 +253,24 @@ struct ext2_inode {
   } osd2;   /* OS dependent 2 */
 };
 
+/*
+ * Extent cache: runs of logically and physically contiguous
+ * blocks that ext2_bmap() has already resolved, kept sorted
+ * by logical block so a lookup is a binary search.
+ */
+#define EXT2_NEXTENT  8
+
+struct ext2_extent {
+  uint32 lblk;  /* First logical block of the run */
+  uint32 pblk;  /* Disk block it lives in */
+  uint32 len;   /* Number of blocks */
+};
+
 struct ext2_inode_info {
   struct ext2_inode i_ei;
   uint flags;
+  int i_nextent;
+  struct ext2_extent i_extent[EXT2_NEXTENT];
 };
 
 #define EXT2_ROOT_INO  2  /* Root inode */
@@ -268,6 +300,47 @@ struct ext2_dir_entry_2 {
   char   name[];     /* File name, up to EXT2_NAME_LEN */
 };
 
+/*
+ * Hashed directory index (dir_index, "htree").
+ *
+ * Block 0 of an indexed directory holds "." and a ".." whose
+ * rec_len covers the rest of the block, so ext2 code that does
+ * not know about the index sees an ordinary directory block.
+ * Behind them sits a dx_root_info and an array of dx_entry,
+ * sorted by hash; the first entry's hash field is the
+ * dx_countlimit.  Index nodes (indirect_levels 1) are blocks
+ * with a single empty dirent followed by the same array.  The
+ * leaves are ordinary directory blocks.
+ */
+struct dx_root_info {
+  uint32 reserved_zero;
+  uint8  hash_version;
+  uint8  info_length;   /* 8 */
+  uint8  indirect_levels;
+  uint8  unused_flags;
+};
+
+struct dx_entry {
+  uint32 hash;
+  uint32 block;         /* Logical block in the directory */
+};
+
+struct dx_countlimit {
+  uint16 limit;
+  uint16 count;
+};
+
+#define DX_ROOT_INFO  24  /* Offset of dx_root_info in block 0 */
+#define DX_NODE_HDR   8   /* Size of the fake dirent of an index node */
+#define DX_MAXLEVELS  2
+
+#define DX_HASH_LEGACY             0
+#define DX_HASH_HALF_MD4           1
+#define DX_HASH_TEA                2
+#define DX_HASH_LEGACY_UNSIGNED    3
+#define DX_HASH_HALF_MD4_UNSIGNED  4
+#define DX_HASH_TEA_UNSIGNED       5
+
 /*
  * Structure of a blocks group descriptor
  */
@@ -327,9 +400,20 @@ struct ext2_group_desc
 #define EXT2_HAS_RO_COMPAT_FEATURE(sb,mask)    \
   ( EXT2_SB(sb)->s_es->s_feature_ro_compat & mask )
 
+#define EXT3_FEATURE_COMPAT_HAS_JOURNAL 0x0004
+/* xv6's own: the journal inode holds an xv6 log ring, not jbd records */
+#define EXT2_FEATURE_INCOMPAT_XV6_LOG   0x80000000
+#define EXT2_FEATURE_COMPAT_DIR_INDEX   0x0020
 #define EXT2_FEATURE_INCOMPAT_META_BG   0x0010
 #define EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER	0x0001
 
+/* s_flags */
+#define EXT2_FLAGS_SIGNED_HASH    0x0001
+#define EXT2_FLAGS_UNSIGNED_HASH  0x0002
+
+/* i_flags */
+#define EXT2_INDEX_FL   0x00001000  /* Hash-indexed directory */
+
 static inline ext2_fsblk_t
 ext2_group_first_block_no(struct superblock *sb, unsigned long group_no)
 {
@@ -345,6 +429,7 @@ int            ext2_unmount(struct inode *);
 struct inode*  ext2_getroot();
 void           ext2_readsb(int dev, struct superblock *sb);
 struct inode*  ext2_ialloc(uint dev, short type);
+void           ext2_free_inode(struct inode *inode);
 uint           ext2_balloc(uint dev);
 void           ext2_bzero(int dev, int bno);
 void           ext2_bfree(int dev, uint b);
@@ -357,6 +442,7 @@ void           ext2_iupdate(struct inode *ip);
 void           ext2_itrunc(struct inode *ip);
 void           ext2_cleanup(struct inode *ip);
 uint           ext2_bmap(struct inode *ip, uint bn);
+uint           ext2_blookup(struct inode *ip, uint bn);
 void           ext2_ilock(struct inode* ip);
 void           ext2_iunlock(struct inode* ip);
 void           ext2_stati(struct inode *ip, struct stat *st);
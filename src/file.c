@@ -91,6 +91,47 @@ filestat(struct file *f, struct stat *st)
   return -1;
 }
 
+// Sequential read-ahead.  A read of n bytes at off that
+// starts where the previous one ended is sequential: the
+// window doubles, up to RAMAX blocks, and the blocks past
+// the read that have not been asked for yet are queued for
+// the disk without waiting.  Any other read closes the
+// window.  Caller must hold f->ip locked.
+static void
+readahead(struct file *f, uint off, uint n)
+{
+  struct inode *ip;
+  uint bsize, bn, end, last, addr;
+
+  ip = f->ip;
+  if(ip->type == T_DEV || ip->size == 0)
+    return;
+  if(off != f->raoff){
+    f->raoff = off + n;
+    f->rawin = 0;
+    f->rablk = 0;
+    return;
+  }
+  f->raoff = off + n;
+  f->rawin = f->rawin ? min(f->rawin * 2, RAMAX) : RAMIN;
+
+  // Top up the window once half of it has been consumed.
+  bsize = sb[ip->dev].blocksize;
+  bn = (off + n) / bsize;
+  if(f->rablk > bn + f->rawin / 2)
+    return;
+  if(f->rablk > bn)
+    bn = f->rablk;
+  end = (off + n) / bsize + f->rawin;
+  last = (ip->size - 1) / bsize;
+  if(end > last + 1)
+    end = last + 1;
+  for(; bn < end; bn++)
+    if((addr = ip->iops->blookup(ip, bn)) != 0)
+      breada(ip->dev, addr);
+  f->rablk = end;
+}
+
 // Read from file f.
 int
 fileread(struct file *f, char *addr, int n)
@@ -103,8 +144,10 @@ fileread(struct file *f, char *addr, int n)
     return piperead(f->pipe, addr, n);
   if(f->type == FD_INODE){
     f->ip->iops->ilock(f->ip);
-    if((r = f->ip->iops->readi(f->ip, addr, f->off, n)) > 0)
+    if((r = f->ip->iops->readi(f->ip, addr, f->off, n)) > 0){
+      readahead(f, f->off, r);
       f->off += r;
+    }
     f->ip->iops->iunlock(f->ip);
     return r;
   }
@@ -124,19 +167,20 @@ filewrite(struct file *f, char *addr, int n)
     return pipewrite(f->pipe, addr, n);
   if(f->type == FD_INODE){
     // write a few blocks at a time to avoid exceeding
-    // the maximum log transaction size, including
-    // i-node, indirect block, allocation blocks,
-    // and 2 blocks of slop for non-aligned writes.
+    // the maximum log transaction size, and reserve log
+    // room for the blocks each piece touches, their
+    // allocation blocks, the i-node, up to three levels of
+    // indirect blocks and an ext2 group descriptor.
     // this really belongs lower down, since writei()
     // might be writing a device like the console.
-    int max = ((LOGSIZE-1-1-2) / 2) * 512;
+    int max = ((MAXOPBLOCKS*3-1-1-2) / 2) * 512;
     int i = 0;
     while(i < n){
       int n1 = n - i;
       if(n1 > max)
         n1 = max;
 
-      begin_op();
+      begin_opn(2*((f->off % 512 + n1 + 511) / 512) + 6);
       f->ip->iops->ilock(f->ip);
       if ((r = f->ip->iops->writei(f->ip, addr + i, f->off, n1)) > 0)
         f->off += r;
@@ -12,6 +12,9 @@ struct file {
   struct pipe *pipe;
   struct inode *ip;
   uint off;
+  uint raoff;  // Read-ahead: where a sequential read would start
+  uint rawin;  // Read-ahead window in blocks, 0 if not sequential
+  uint rablk;  // First block not read ahead yet
 };
 
 struct superblock sb[NDEV];
@@ -1,5 +1,10 @@
 #include "find_bits.h"
 
+// Whole words are skipped four at a time: an allocation bitmap
+// is mostly long stretches of full (or empty) words, and the
+// AND (OR) of four words costs about as much as testing one.
+#define BITOP_STRIDE (4 * BITS_PER_LONG)
+
 unsigned long
 find_next_zero_bit(const unsigned long *addr, unsigned long size,
     unsigned long offset)
@@ -22,6 +27,11 @@ find_next_zero_bit(const unsigned long *addr, unsigned long size,
     size -= BITS_PER_LONG;
     result += BITS_PER_LONG;
   }
+  while (size >= BITOP_STRIDE && (p[0] & p[1] & p[2] & p[3]) == ~0UL) {
+    p += 4;
+    result += BITOP_STRIDE;
+    size -= BITOP_STRIDE;
+  }
   while (size & ~(BITS_PER_LONG-1)) {
     if (~(tmp = *(p++)))
       goto found_middle;
@@ -40,3 +50,80 @@ found_middle:
   return result + ffz(tmp);
 }
 
+unsigned long
+find_next_bit(const unsigned long *addr, unsigned long size,
+    unsigned long offset)
+{
+  const unsigned long *p = addr + BITOP_WORD(offset);
+  unsigned long result = offset & ~(BITS_PER_LONG-1);
+  unsigned long tmp;
+
+  if (offset >= size)
+    return size;
+  size -= result;
+  offset %= BITS_PER_LONG;
+  if (offset) {
+    tmp = *(p++);
+    tmp &= ~0UL << offset;
+    if (size < BITS_PER_LONG)
+      goto found_first;
+    if (tmp)
+      goto found_middle;
+    size -= BITS_PER_LONG;
+    result += BITS_PER_LONG;
+  }
+  while (size >= BITOP_STRIDE && (p[0] | p[1] | p[2] | p[3]) == 0) {
+    p += 4;
+    result += BITOP_STRIDE;
+    size -= BITOP_STRIDE;
+  }
+  while (size & ~(BITS_PER_LONG-1)) {
+    if ((tmp = *(p++)))
+      goto found_middle;
+    result += BITS_PER_LONG;
+    size -= BITS_PER_LONG;
+  }
+  if (!size)
+    return result;
+  tmp = *p;
+
+found_first:
+  tmp &= ~0UL >> (BITS_PER_LONG - size);
+  if (tmp == 0UL)   /* Are any bits set? */
+    return result + size;   /* Nope. */
+found_middle:
+  return result + __ffs(tmp);
+}
+
+// The first run of at least len zero bits that starts at or
+// after offset.
+unsigned long
+find_zero_run(const unsigned long *addr, unsigned long size,
+    unsigned long offset, unsigned long len)
+{
+  unsigned long b, e;
+
+  for (b = find_next_zero_bit(addr, size, offset); b < size;
+       b = find_next_zero_bit(addr, size, e)) {
+    if (size - b < len)
+      break;
+    // Only look as far as the run needs to reach.
+    e = find_next_bit(addr, b + len, b);
+    if (e == b + len)
+      return b;
+  }
+  return size;
+}
+
+// The number of set bits among the first size.
+unsigned long
+bitmap_weight(const unsigned long *addr, unsigned long size)
+{
+  unsigned long k, w = 0;
+
+  for (k = 0; k < size / BITS_PER_LONG; k++)
+    w += hweight_long(addr[k]);
+  if (size % BITS_PER_LONG)
+    w += hweight_long(addr[k] & (~0UL >> (BITS_PER_LONG - size % BITS_PER_LONG)));
+  return w;
+}
@@ -1,9 +1,15 @@
 #ifndef XV6_FIND_BITS_H_
 #define XV6_FIND_BITS_H_
 
+// Bitmap search, in the little-endian bit order of the ext2
+// and s5 bitmaps.  Sizes and offsets are in bits; a search
+// that finds nothing returns size.
 unsigned long find_next_zero_bit(const unsigned long *addr, unsigned long size, unsigned long offset);
+unsigned long find_next_bit(const unsigned long *addr, unsigned long size, unsigned long offset);
+unsigned long find_zero_run(const unsigned long *addr, unsigned long size, unsigned long offset, unsigned long len);
+unsigned long bitmap_weight(const unsigned long *addr, unsigned long size);
 
-#define BITS_PER_LONG 32
+#define BITS_PER_LONG (8 * sizeof(unsigned long))
 
 #define BITOP_WORD(nr) ((nr) / BITS_PER_LONG)
 
@@ -35,6 +41,16 @@ static inline unsigned long ffz(unsigned long word)
   return word;
 }
 
+/**
+ * hweight_long - count the set bits in word
+ * @word: The word to count
+ */
+static inline unsigned long hweight_long(unsigned long word)
+{
+  word -= (word >> 1) & (~0UL / 3);
+  word = (word & (~0UL / 15 * 3)) + ((word >> 2) & (~0UL / 15 * 3));
+  word = (word + (word >> 4)) & (~0UL / 255 * 15);
+  return (word * (~0UL / 255)) >> (sizeof(unsigned long) - 1) * 8;
+}
 
 #endif /* XV6_FIND_BITS_H_ */
-
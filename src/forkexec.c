@@ -0,0 +1,113 @@
+// Measure fork and fork+exec latency from a large parent.
+//
+// usage: forkexec [n] [kb]
+//
+// Grows itself by kb (default 1024) kilobytes of touched
+// memory, then times n (default 200) rounds of fork+exit and
+// of fork+exec of a program that exits at once, like sh does
+// for every command.  With copy-on-write fork the cost and
+// the pages allocated per fork should barely depend on kb.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "iostat.h"
+
+#define PGSIZE 4096
+
+char *argvx[] = { "forkexec", "-x", 0 };
+
+void
+report(char *what, int n, int t, struct iostat *s0, struct iostat *s1)
+{
+  printf(1, "  %s: %d in %d ticks", what, n, t);
+  if(t > 0)
+    printf(1, " (%d/s)", n * 100 / t);
+  printf(1, ", %d pages each\n", (s1->kallocs - s0->kallocs) / n);
+}
+
+// A child writing to memory it shares with its parent must
+// not change the parent's copy.
+void
+cowcheck(char *mem)
+{
+  int pid;
+
+  mem[0] = 'p';
+  pid = fork();
+  if(pid < 0){
+    printf(2, "forkexec: fork failed\n");
+    exit();
+  }
+  if(pid == 0){
+    mem[0] = 'c';
+    exit();
+  }
+  wait();
+  if(mem[0] != 'p'){
+    printf(2, "forkexec: child's write showed up in parent\n");
+    exit();
+  }
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct iostat s0, s1;
+  int i, n, kb, pid, t;
+  char *mem;
+
+  if(argc > 1 && strcmp(argv[1], "-x") == 0)
+    exit();
+  n = 200;
+  kb = 1024;
+  if(argc > 1)
+    n = atoi(argv[1]);
+  if(argc > 2)
+    kb = atoi(argv[2]);
+  if(n <= 0)
+    n = 1;
+
+  if((mem = sbrk(kb * 1024)) == (char*)-1){
+    printf(2, "forkexec: cannot grow by %d KB\n", kb);
+    exit();
+  }
+  for(i = 0; i < kb * 1024; i += PGSIZE)
+    mem[i] = 1;
+  cowcheck(mem);
+  printf(1, "forkexec: %d KB process\n", kb);
+
+  iostat(&s0);
+  t = uptime();
+  for(i = 0; i < n; i++){
+    if((pid = fork()) < 0){
+      printf(2, "forkexec: fork failed\n");
+      exit();
+    }
+    if(pid == 0)
+      exit();
+    wait();
+  }
+  t = uptime() - t;
+  iostat(&s1);
+  report("fork+exit", n, t, &s0, &s1);
+
+  iostat(&s0);
+  t = uptime();
+  for(i = 0; i < n; i++){
+    if((pid = fork()) < 0){
+      printf(2, "forkexec: fork failed\n");
+      exit();
+    }
+    if(pid == 0){
+      exec(argvx[0], argvx);
+      printf(2, "forkexec: exec %s failed\n", argvx[0]);
+      exit();
+    }
+    wait();
+  }
+  t = uptime() - t;
+  iostat(&s1);
+  report("fork+exec", n, t, &s0, &s1);
+  exit();
+}
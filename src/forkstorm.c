@@ -0,0 +1,82 @@
+// Measure page allocator throughput under fork/exit churn.
+//
+// usage: forkstorm [nworkers] [nforks] [npages]
+//
+// Starts nworkers (default 4) processes that each fork and
+// reap nforks (default 500) children; every child grows by
+// npages (default 16) pages before it exits.  Run it with
+// make qemu CPUS=1, 2, 4, ... to see how page allocation
+// scales with the number of CPUs.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "iostat.h"
+
+#define PGSIZE 4096
+
+void
+worker(int nforks, int npages)
+{
+  char *p;
+  int i, j;
+
+  for(i = 0; i < nforks; i++){
+    switch(fork()){
+    case -1:
+      printf(2, "forkstorm: fork failed\n");
+      exit();
+    case 0:
+      if((p = sbrk(npages * PGSIZE)) == (char*)-1)
+        exit();
+      for(j = 0; j < npages; j++)
+        p[j * PGSIZE] = 1;
+      exit();
+    default:
+      wait();
+    }
+  }
+  exit();
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct iostat s0, s1;
+  int i, nworkers, nforks, npages, n, t;
+
+  nworkers = 4;
+  nforks = 500;
+  npages = 16;
+  if(argc > 1)
+    nworkers = atoi(argv[1]);
+  if(argc > 2)
+    nforks = atoi(argv[2]);
+  if(argc > 3)
+    npages = atoi(argv[3]);
+
+  iostat(&s0);
+  t = uptime();
+  for(i = 0; i < nworkers; i++){
+    switch(fork()){
+    case -1:
+      printf(2, "forkstorm: fork failed\n");
+      exit();
+    case 0:
+      worker(nforks, npages);
+    }
+  }
+  for(i = 0; i < nworkers; i++)
+    wait();
+  t = uptime() - t;
+  iostat(&s1);
+
+  n = s1.kallocs - s0.kallocs;
+  printf(1, "forkstorm: %d workers, %d forks: %d pages in %d ticks",
+    nworkers, nworkers * nforks, n, t);
+  if(t > 0)
+    printf(1, " (%d pages/s, %d forks/s)", n * 100 / t, nworkers * nforks * 100 / t);
+  printf(1, "\n  %d refills, %d drains of the per-CPU page caches\n",
+    s1.krefills - s0.krefills, s1.kdrains - s0.kdrains);
+  exit();
+}
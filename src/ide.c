@@ -1,4 +1,5 @@
-// Simple PIO-based (non-DMA) IDE driver code.
+// Simple IDE driver code: bus-master DMA on a PIIX-compatible
+// controller, programmed I/O (PIO) otherwise.
 
 #include "types.h"
 #include "defs.h"
@@ -13,6 +14,7 @@
 #include "buf.h"
 #include "device.h"
 #include "s5.h"
+#include "iostat.h"
 
 #define SECTOR_SIZE   512
 #define IDE_BSY       0x80
@@ -26,16 +28,73 @@
 #define IDE_CMD_READ_MUL  0xC4
 #define IDE_CMD_WRITE_MUL 0xC5
 #define IDE_CMD_SET_MUL   0xC6
+#define IDE_CMD_READ_DMA  0xC8
+#define IDE_CMD_WRITE_DMA 0xCA
+
+// Bus master IDE registers, relative to a channel's bmbase.
+#define BM_CMD        0
+#define BM_STATUS     2
+#define BM_PRDT       4
+#define BM_CMD_START  0x01
+#define BM_CMD_READ   0x08  // device to memory
+#define BM_ST_ERR     0x02
+#define BM_ST_INTR    0x04
+
+#define MAXSECT 128   // max sectors in one merged command
+
+// Physical region descriptor: one piece of memory of a DMA
+// transfer.  A buffer's data never crosses a page, so one
+// descriptor per buffer does not cross 64 KB either.
+struct prd {
+  uint addr;
+  ushort len;
+  ushort flags;
+};
+#define PRD_EOT 0x8000  // last descriptor of the table
+
+// Requests wait in a queue per IDE channel, sorted by position
+// on the channel (drive, then sector).  Each channel works on
+// one request at a time, picked in C-LOOK order: the first
+// queued request at or after where the channel's last request
+// ended, or the lowest one if none is left ahead.  Queued
+// requests for the blocks right after it, in the same
+// direction, are merged into the same command.  The channels
+// are independent and have a lock each, so the root disk and
+// a disk mounted on the secondary channel run in parallel.
+//
+// With DMA, the controller moves the data of every buffer of a
+// merged command, one PRD table entry each, and interrupts once
+// at the end.  With PIO, the CPU copies each block and there is
+// an interrupt per block.  A DMA error switches the channel to
+// PIO and retries the command.
+//
+// active points to the buf now being read/written to the disk.
+// active->qnext points to the rest of the merged command.
+// You must hold the channel's lock while manipulating its queue.
+
+struct idechan {
+  struct spinlock lock;
+  int base;             // Command block registers
+  int ctl;              // Device control register
+  struct buf *queue;    // Waiting requests, sorted by idepos()
+  struct buf *active;   // Request on the disk
+  uint pos;             // Where the last request ended
+  uint ioreqs;          // Commands sent to the disks
+  uint iomerged;        // Requests merged into another's command
+  int bmbase;           // Bus master registers, 0 if none
+  int dma;              // Use DMA for new commands
+  int indma;            // Active command uses DMA
+  int nsect;            // Sectors in the active command
+  struct prd *prdt;     // PRD table
+};
 
-// idequeue points to the buf now being read/written to the disk.
-// idequeue->qnext points to the next buf to be processed.
-// You must hold idelock while manipulating queue.
+static struct idechan idechan[2];
 
-static struct spinlock idelock;
-static struct buf *idequeue;
+// One table per channel, 1 KB aligned so it does not cross 64 KB.
+static struct prd prdt[2][MAXSECT] __attribute__((aligned(1024)));
 
 static int havediskroot;
-static void idestart(struct buf*);
+static void idestart(struct idechan*, struct buf*, int);
 static int ide_open(int minor);
 static int ide_close(int minor);
 
@@ -106,12 +165,81 @@ idewait(int checkerr, int baseport)
   return 0;
 }
 
+// PCI configuration space access, mechanism #1.
+static uint
+pciread(int dev, int func, int off)
+{
+  outl(0xcf8, 0x80000000 | dev<<11 | func<<8 | (off & 0xfc));
+  return inl(0xcfc);
+}
+
+static void
+pciwrite(int dev, int func, int off, uint v)
+{
+  outl(0xcf8, 0x80000000 | dev<<11 | func<<8 | (off & 0xfc));
+  outl(0xcfc, v);
+}
+
+// Look on PCI bus 0 for an IDE controller that can do
+// bus-master DMA, like QEMU's PIIX3, and turn DMA on.
+static void
+idedmainit(void)
+{
+  int dev, func, bar;
+
+  for(dev = 0; dev < 32; dev++){
+    for(func = 0; func < 8; func++){
+      if((pciread(dev, func, 0x00) & 0xffff) == 0xffff)
+        continue;
+      if((pciread(dev, func, 0x08) >> 16) != 0x0101)  // mass storage, IDE
+        continue;
+      bar = pciread(dev, func, 0x20);  // BAR4
+      if(!(bar & 1) || (bar & 0xfffc) == 0)
+        continue;
+      // Enable I/O space and bus mastering.
+      pciwrite(dev, func, 0x04, (pciread(dev, func, 0x04) & 0xffff) | 0x5);
+      idechan[0].bmbase = bar & 0xfffc;
+      idechan[1].bmbase = (bar & 0xfffc) + 8;
+      idechan[0].dma = idechan[1].dma = 1;
+      cprintf("ide: bus-master DMA at 0x%x\n", bar & 0xfffc);
+      return;
+    }
+  }
+}
+
+// Turn DMA on or off for both channels.  Returns whether
+// it was on before, or -1 if there is no DMA controller.
+int
+idedma(int on)
+{
+  struct idechan *c;
+  int old;
+
+  if(idechan[0].bmbase == 0)
+    return -1;
+  old = idechan[0].dma;
+  for(c = idechan; c < &idechan[2]; c++){
+    acquire(&c->lock);
+    c->dma = on != 0;
+    release(&c->lock);
+  }
+  return old;
+}
+
 void
 ideinit(void)
 {
   int i;
 
-  initlock(&idelock, "ide");
+  initlock(&idechan[0].lock, "ide0");
+  initlock(&idechan[1].lock, "ide1");
+  idechan[0].base = 0x1f0;
+  idechan[0].ctl = 0x3f6;
+  idechan[1].base = 0x170;
+  idechan[1].ctl = 0x376;
+  idechan[0].prdt = prdt[0];
+  idechan[1].prdt = prdt[1];
+  idedmainit();
   picenable(IRQ_IDE);
   ioapicenable(IRQ_IDE, ncpu - 1);
   picenable(IRQ_IDE + 1);
@@ -135,122 +263,326 @@ ideinit(void)
   outb(0x1f6, 0xe0 | (0<<4));
 }
 
-// Start the request for b.  Caller must hold idelock.
+// Verify if the device is from Primary or Secodary BUS
+static struct idechan*
+idechanof(struct buf *b)
+{
+  if (b->dev <= 1)
+    return &idechan[0];
+  return &idechan[1];
+}
+
+// Position of b on its channel: drive, then first sector.
+static uint
+idepos(struct buf *b)
+{
+  return (b->dev & 1) << 28 | b->blockno * (b->bsize / SECTOR_SIZE);
+}
+
+// Start the request for b and the nsect - b->bsize/SECTOR_SIZE
+// sectors of the bufs chained after it on channel c.
+// Caller must hold c->lock.
 static void
-idestart(struct buf *b)
+idestart(struct idechan *c, struct buf *b, int nsect)
 {
+  struct prd *p;
+  struct buf *x;
+
   if(b == 0)
     panic("idestart");
   /* if(b->blockno >= FSSIZE) */
   /*   panic("incorrect blockno"); */
 
-  // Verify if the device is from Primary or Secodary BUS
-  int baseport;
-  if (b->dev <= 1) {
-    baseport = 0x1f0;
-  } else {
-    baseport = 0x170;
-  }
-
   int sector_per_block =  b->bsize/SECTOR_SIZE;
   int sector = b->blockno * sector_per_block;
 
-  if (sector_per_block > 16) panic("idestart");
+  if (sector_per_block > 16 || nsect > MAXSECT) panic("idestart");
+
+  c->nsect = nsect;
+  c->indma = c->dma;
+
+  idewait(0, c->base);
 
-  idewait(0, baseport);
+  outb(c->ctl, 0);  // generate interrupt
 
-  if (b->dev <= 1) {
-    outb(0x3f6, 0);  // generate interrupt to primary bus
+  outb(c->base + 6, 0xe0 | ((b->dev&1)<<4) | ((sector>>24)&0x0f));
+  if(c->indma){
+    // Describe the data of every buffer in the command.
+    p = c->prdt;
+    for(x = b; x; x = x->qnext, p++){
+      p->addr = v2p(x->data);
+      p->len = x->bsize;
+      p->flags = 0;
+    }
+    p[-1].flags = PRD_EOT;
+    outb(c->bmbase + BM_CMD, 0);
+    outl(c->bmbase + BM_PRDT, v2p(c->prdt));
+    outb(c->bmbase + BM_STATUS, BM_ST_ERR | BM_ST_INTR);  // clear
+    outb(c->bmbase + BM_CMD, (b->flags & B_DIRTY) ? 0 : BM_CMD_READ);
   } else {
-    outb(0x376, 0);  // generate interrupt to secondary bus
+    // One interrupt per block.
+    outb(c->base + 2, sector_per_block);
+    outb(c->base + 7, IDE_CMD_SET_MUL);
+    idewait(0, c->base);
   }
 
-  outb(baseport + 2, sector_per_block);  // number of sectors
-  outb(baseport + 7, IDE_CMD_SET_MUL);
-  idewait(0, baseport);
+  outb(c->base + 2, nsect);  // number of sectors
+  outb(c->base + 3, sector & 0xff);
+  outb(c->base + 4, (sector >> 8) & 0xff);
+  outb(c->base + 5, (sector >> 16) & 0xff);
+  outb(c->base + 6, 0xe0 | ((b->dev&1)<<4) | ((sector>>24)&0x0f));
+
+  if(c->indma){
+    outb(c->base + 7, (b->flags & B_DIRTY) ? IDE_CMD_WRITE_DMA : IDE_CMD_READ_DMA);
+    outb(c->bmbase + BM_CMD, inb(c->bmbase + BM_CMD) | BM_CMD_START);
+  } else if(b->flags & B_DIRTY){
+    outb(c->base + 7, IDE_CMD_WRITE_MUL);
+    outsl(c->base, b->data, b->bsize/4);
+  } else {
+    outb(c->base + 7, IDE_CMD_READ_MUL);
+  }
+}
 
-  outb(baseport + 3, sector & 0xff);
-  outb(baseport + 4, (sector >> 8) & 0xff);
-  outb(baseport + 5, (sector >> 16) & 0xff);
-  outb(baseport + 6, 0xe0 | ((b->dev&1)<<4) | ((sector>>24)&0x0f));
+// Start the next request on channel c, if it is idle and
+// there is one.  Caller must hold c->lock.
+static void
+idestartnext(struct idechan *c)
+{
+  struct buf **pp, *b, *last, *n;
+  int spb, nsect;
 
-  if(b->flags & B_DIRTY){
-    outb(baseport + 7, IDE_CMD_WRITE_MUL);
-    outsl(baseport, b->data, b->bsize/4);
-  } else {
-    outb(baseport + 7, IDE_CMD_READ_MUL);
+  if(c->active != 0 || c->queue == 0)
+    return;
+
+  // C-LOOK: first request at or past the last position.
+  for(pp = &c->queue; *pp && idepos(*pp) < c->pos; pp = &(*pp)->qnext)
+    ;
+  if(*pp == 0)
+    pp = &c->queue;
+
+  // Merge the requests for the blocks right after it.
+  b = *pp;
+  spb = b->bsize / SECTOR_SIZE;
+  nsect = spb;
+  for(last = b; (n = last->qnext) != 0; last = n){
+    if(n->dev != b->dev || n->bsize != b->bsize ||
+       (n->flags & B_DIRTY) != (b->flags & B_DIRTY) ||
+       idepos(n) != idepos(last) + spb || nsect + spb > MAXSECT)
+      break;
+    nsect += spb;
+    c->iomerged++;
   }
+  *pp = last->qnext;
+  last->qnext = 0;
+  c->pos = idepos(last) + spb;
+
+  c->active = b;
+  c->ioreqs++;
+  idestart(c, b, nsect);
 }
 
 // Interrupt handler.
 void
 ideintr(int secflag)
 {
-  int port;
-  if (!secflag) {
-    port = 0x1f0;
-  } else {
-    port = 0x170;
-  }
+  struct idechan *c;
+  struct buf *b, *next, *done;
+  void (*iodone)(struct buf*);
+  int port, st, r;
 
-  struct buf *b;
+  c = &idechan[secflag];
+  port = c->base;
 
-  // First queued buffer is the active request.
-  acquire(&idelock);
-  if((b = idequeue) == 0){
-    release(&idelock);
+  acquire(&c->lock);
+  if((b = c->active) == 0){
+    release(&c->lock);
     return;
   }
-  idequeue = b->qnext;
 
-  // Read data if needed.
-  if(!(b->flags & B_DIRTY) && idewait(1, port) >= 0)
-    insl(port, b->data, b->bsize/4);
+  done = 0;
+  if(c->indma){
+    // The whole command is done.
+    st = inb(c->bmbase + BM_STATUS);
+    outb(c->bmbase + BM_CMD, 0);
+    outb(c->bmbase + BM_STATUS, BM_ST_ERR | BM_ST_INTR);
+    r = inb(port + 7);
+    if((st & BM_ST_ERR) || (r & (IDE_DF|IDE_ERR))){
+      cprintf("ide%d: DMA error, using PIO\n", secflag);
+      c->dma = 0;
+      idestart(c, b, c->nsect);
+      release(&c->lock);
+      return;
+    }
+    c->active = 0;
+  } else {
+    // First buffer of the active command is the one done.
+    c->active = b->qnext;
+    b->qnext = 0;
 
-  // Wake process waiting for this buf.
-  b->flags |= B_VALID;
-  b->flags &= ~B_DIRTY;
-  wakeup(b);
+    // Read data if needed.
+    if(!(b->flags & B_DIRTY) && idewait(1, port) >= 0)
+      insl(port, b->data, b->bsize/4);
+  }
 
-  // Start disk on next buf in queue.
-  if(idequeue != 0)
-    idestart(idequeue);
+  // Wake processes waiting for these bufs, and collect the ones
+  // with a completion callback.  Nobody else touches those
+  // until the callback runs, so they can be chained on qnext.
+  while(b){
+    next = b->qnext;
+    b->flags |= B_VALID;
+    b->flags &= ~B_DIRTY;
+    wakeup(b);
+    if(b->iodone){
+      b->qnext = done;
+      done = b;
+    }
+    b = next;
+  }
 
-  release(&idelock);
+  if(c->active != 0){
+    // Rest of a PIO merged command; a write needs the next block.
+    if(c->active->flags & B_DIRTY){
+      idewait(0, port);
+      outsl(port, c->active->data, c->active->bsize/4);
+    }
+  } else {
+    // Start disk on next request.
+    idestartnext(c);
+  }
+
+  release(&c->lock);
+
+  // A completion callback may release or reuse its buf,
+  // so call them with no locks held.
+  for(; done; done = b){
+    b = done->qnext;
+    iodone = done->iodone;
+    done->iodone = 0;
+    iodone(done);
+  }
 }
 
 //PAGEBREAK!
-// Sync buf with disk.
-// If B_DIRTY is set, write buf to disk, clear B_DIRTY, set B_VALID.
-// Else if B_VALID is not set, read buf from disk, set B_VALID.
-void
-iderw(struct buf *b)
-{
-  struct buf **pp;
+// Block I/O requests.
+//
+// idesubmit() queues a buffer for the disk and returns at once:
+// the buffer is written if B_DIRTY is set and read otherwise.
+// When the disk is done, ideintr() sets B_VALID, clears B_DIRTY,
+// wakes up processes sleeping on the buffer and calls
+// b->iodone(b), if set, from the interrupt handler.  The buffer
+// must stay B_BUSY until then.  idesubmitv() queues several
+// buffers and starts each disk once, ideiowait() waits
+// for a request to finish and iderwv() does both for a set of
+// buffers, so a caller can keep the disk busy and sleep once.
 
+static void
+idecheck(struct buf *b)
+{
   if(!(b->flags & B_BUSY))
     panic("iderw: buf not busy");
   if((b->flags & (B_VALID|B_DIRTY)) == B_VALID)
     panic("iderw: nothing to do");
   if(b->dev != 0 && !havediskroot)
     panic("iderw: ide disk 1 not present");
+}
 
-  acquire(&idelock);  //DOC:acquire-lock
+// Insert b in its channel's queue, in disk order.
+// Caller must hold the channel's lock.
+static void
+ideenqueue(struct buf *b)
+{
+  struct buf **pp;
+  uint pos;
 
-  // Append b to idequeue.
-  b->qnext = 0;
-  for(pp=&idequeue; *pp; pp=&(*pp)->qnext)  //DOC:insert-queue
+  pos = idepos(b);
+  for(pp=&idechanof(b)->queue; *pp && idepos(*pp) <= pos; pp=&(*pp)->qnext)  //DOC:insert-queue
     ;
+  b->qnext = *pp;
   *pp = b;
+}
+
+// Queue b for the disk and return without waiting.
+void
+idesubmit(struct buf *b)
+{
+  idesubmitv(&b, 1);
+}
+
+// Queue n buffers for the disk and return without waiting.
+void
+idesubmitv(struct buf **bv, int n)
+{
+  struct idechan *c;
+  int i;
 
-  // Start disk if necessary.
-  if(idequeue == b)
-    idestart(b);
+  for(i = 0; i < n; i++)
+    idecheck(bv[i]);
 
-  // Wait for request to finish.
+  // Queue everything before starting the disks,
+  // so that the requests can be sorted and merged.
+  for(i = 0; i < n; i++){
+    c = idechanof(bv[i]);
+    acquire(&c->lock);  //DOC:acquire-lock
+    ideenqueue(bv[i]);
+    release(&c->lock);
+  }
+  for(c = idechan; c < &idechan[2]; c++){
+    acquire(&c->lock);
+    idestartnext(c);
+    release(&c->lock);
+  }
+}
+
+// Wait for the request for b to finish.
+void
+ideiowait(struct buf *b)
+{
+  struct idechan *c;
+
+  c = idechanof(b);
+  acquire(&c->lock);
   while((b->flags & (B_VALID|B_DIRTY)) != B_VALID){
-    sleep(b, &idelock);
+    sleep(b, &c->lock);
   }
+  release(&c->lock);
+}
+
+// Sync n buffers with disk and wait until all are done.
+void
+iderwv(struct buf **bv, int n)
+{
+  int i;
+
+  for(i = 0; i < n; i++)
+    bv[i]->iodone = 0;
+  idesubmitv(bv, n);
 
-  release(&idelock);
+  // Wait for the requests to finish.
+  for(i = 0; i < n; i++)
+    ideiowait(bv[i]);
+}
+
+// Sync buf with disk.
+// If B_DIRTY is set, write buf to disk, clear B_DIRTY, set B_VALID.
+// Else if B_VALID is not set, read buf from disk, set B_VALID.
+void
+iderw(struct buf *b)
+{
+  iderwv(&b, 1);
+}
+
+// Copy disk request statistics to st.
+void
+idestat(struct iostat *st)
+{
+  struct idechan *c;
+
+  st->ioreqs = 0;
+  st->iomerged = 0;
+  for(c = idechan; c < &idechan[2]; c++){
+    acquire(&c->lock);
+    st->ioreqs += c->ioreqs;
+    st->iomerged += c->iomerged;
+    release(&c->lock);
+  }
 }
@@ -0,0 +1,29 @@
+#ifndef XV6_IOSTAT_H_
+#define XV6_IOSTAT_H_
+
+// Block I/O statistics, filled in by the iostat system call.
+struct iostat {
+  uint nbuf;      // Number of buffers holding a block
+  uint npages;    // Pages of block data in the cache
+  uint hits;      // bread() found the block cached
+  uint misses;    // bread() had to read the block
+  uint grows;     // Pages the cache took from kalloc()
+  uint shrinks;   // Pages given back when memory ran low
+  uint freepages; // Pages left free in kalloc()
+  uint raissued;  // Blocks read ahead
+  uint rahits;    // bread() found a block read ahead
+  uint ioreqs;    // Commands sent to the disks
+  uint iomerged;  // Requests merged into another's command
+  uint delwri;    // Buffers waiting for write-behind
+  uint wbwrites;  // Blocks written behind
+  uint dhits;     // Path lookups the name cache answered
+  uint dneghits;  // ... with "not there"
+  uint dmisses;   // Path lookups that read the directory
+  uint ehits;     // ext2 bmap() answered by the extent cache
+  uint emisses;   // ext2 bmap() that walked the indirect blocks
+  uint kallocs;   // Pages handed out by kalloc()
+  uint krefills;  // Per-CPU page caches refilled from the global list
+  uint kdrains;   // ... and drained back to it
+};
+
+#endif /* XV6_IOSTAT_H_ */
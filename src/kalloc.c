@@ -8,6 +8,9 @@
 #include "memlayout.h"
 #include "mmu.h"
 #include "spinlock.h"
+#include "x86.h"
+#include "proc.h"
+#include "iostat.h"
 
 void freerange(void *vstart, void *vend);
 extern char end[]; // first address after kernel loaded from ELF file
@@ -20,8 +23,31 @@ struct {
   struct spinlock lock;
   int use_lock;
   struct run *freelist;
+  int nfree;
+  uint refills;     // Batches handed to per-CPU caches
+  uint drains;      // Batches taken back from them
 } kmem;
 
+// Each CPU keeps a small cache of free pages so that most
+// kalloc() and kfree() calls touch no shared lock.  A CPU
+// refills an empty cache, and drains a full one, KBATCH
+// pages at a time under kmem.lock.  The caches are only
+// used once kinit2() has turned locking on.  A cache's lock
+// is taken by its own CPU, with interrupts off, and only
+// contended when another CPU runs out and reclaims its pages.
+struct kcache {
+  struct spinlock lock;
+  struct run *freelist;
+  int nfree;
+  uint allocs;      // Pages handed out by kalloc()
+} kcache[NCPU];
+
+// References to each physical page.  kalloc() hands a page
+// out with one; copy-on-write fork adds one for every page
+// table that shares it, and kfree() only frees the page when
+// the last one goes.
+static uint pgref[PHYSTOP/PGSIZE];
+
 // Initialization happens in two phases.
 // 1. main() calls kinit1() while still using entrypgdir to place just
 // the pages mapped by entrypgdir on free list.
@@ -30,7 +56,11 @@ struct {
 void
 kinit1(void *vstart, void *vend)
 {
+  int i;
+
   initlock(&kmem.lock, "kmem");
+  for(i = 0; i < NCPU; i++)
+    initlock(&kcache[i].lock, "kcache");
   kmem.use_lock = 0;
   freerange(vstart, vend);
 }
@@ -51,6 +81,59 @@ freerange(void *vstart, void *vend)
     kfree(p);
 }
 
+// Move up to n pages from the global list onto c.
+static void
+krefill(struct kcache *c, int n)
+{
+  struct run *r;
+
+  acquire(&kmem.lock);
+  for(; n > 0 && (r = kmem.freelist) != 0; n--){
+    kmem.freelist = r->next;
+    kmem.nfree--;
+    r->next = c->freelist;
+    c->freelist = r;
+    c->nfree++;
+  }
+  kmem.refills++;
+  release(&kmem.lock);
+}
+
+// Move n pages from c back to the global list.
+static void
+kdrain(struct kcache *c, int n)
+{
+  struct run *r;
+
+  acquire(&kmem.lock);
+  for(; n > 0 && (r = c->freelist) != 0; n--){
+    c->freelist = r->next;
+    c->nfree--;
+    r->next = kmem.freelist;
+    kmem.freelist = r;
+    kmem.nfree++;
+  }
+  kmem.drains++;
+  release(&kmem.lock);
+}
+
+// Return the pages cached by the other CPUs to the global
+// list, so that kalloc() does not fail while they still
+// hold free memory.  The caller must not hold self->lock.
+static void
+kreclaim(struct kcache *self)
+{
+  struct kcache *c;
+
+  for(c = kcache; c < &kcache[NCPU]; c++){
+    if(c == self || c->nfree == 0)
+      continue;
+    acquire(&c->lock);
+    kdrain(c, c->nfree);
+    release(&c->lock);
+  }
+}
+
 //PAGEBREAK: 21
 // Free the page of physical memory pointed at by v,
 // which normally should have been returned by a
@@ -59,21 +142,76 @@ freerange(void *vstart, void *vend)
 void
 kfree(char *v)
 {
+  struct kcache *c;
   struct run *r;
+  uint *ref;
 
   if((uint)v % PGSIZE || v < end || v2p(v) >= PHYSTOP)
     panic("kfree");
 
+  // Only the last reference frees the page.  A page with one
+  // reference has no other owner that could race with us.
+  ref = &pgref[v2p(v) / PGSIZE];
+  if(*ref > 1 && xadd(ref, -1) > 1)
+    return;
+  *ref = 0;
+
   // Fill with junk to catch dangling refs.
-  memset(v, 1, PGSIZE);
+  if(KJUNK)
+    memset(v, 1, PGSIZE);
 
-  if(kmem.use_lock)
-    acquire(&kmem.lock);
   r = (struct run*)v;
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  if(kmem.use_lock)
-    release(&kmem.lock);
+  if(!kmem.use_lock){
+    r->next = kmem.freelist;
+    kmem.freelist = r;
+    kmem.nfree++;
+    return;
+  }
+  pushcli();
+  c = &kcache[cpu - cpus];
+  acquire(&c->lock);
+  r->next = c->freelist;
+  c->freelist = r;
+  if(++c->nfree >= 2*KBATCH)
+    kdrain(c, KBATCH);
+  release(&c->lock);
+  popcli();
+}
+
+static struct run*
+kpop(void)
+{
+  struct kcache *c;
+  struct run *r;
+
+  if(!kmem.use_lock){
+    r = kmem.freelist;
+    if(r){
+      kmem.freelist = r->next;
+      kmem.nfree--;
+    }
+    return r;
+  }
+  pushcli();
+  c = &kcache[cpu - cpus];
+  acquire(&c->lock);
+  if(c->freelist == 0)
+    krefill(c, KBATCH);
+  if(c->freelist == 0){
+    release(&c->lock);
+    kreclaim(c);
+    acquire(&c->lock);
+    krefill(c, KBATCH);
+  }
+  r = c->freelist;
+  if(r){
+    c->freelist = r->next;
+    c->nfree--;
+    c->allocs++;
+  }
+  release(&c->lock);
+  popcli();
+  return r;
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -84,13 +222,54 @@ kalloc(void)
 {
   struct run *r;
 
-  if(kmem.use_lock)
-    acquire(&kmem.lock);
-  r = kmem.freelist;
+  r = kpop();
+  if(kmem.use_lock && kfreepages() < PGLOWAT){
+    // Running low; have the buffer cache give some back.
+    bshrink();
+    if(r == 0)
+      r = kpop();
+  }
   if(r)
-    kmem.freelist = r->next;
-  if(kmem.use_lock)
-    release(&kmem.lock);
+    pgref[v2p(r) / PGSIZE] = 1;
   return (char*)r;
 }
 
+// Add a reference to page v, which is shared by another
+// page table now.
+void
+kdup(char *v)
+{
+  xadd(&pgref[v2p(v) / PGSIZE], 1);
+}
+
+// Number of references to page v.
+int
+krefs(char *v)
+{
+  return pgref[v2p(v) / PGSIZE];
+}
+
+// Number of free pages, counting those in per-CPU caches.
+// Unlocked, so only a snapshot.
+int
+kfreepages(void)
+{
+  int i, n;
+
+  n = kmem.nfree;
+  for(i = 0; i < NCPU; i++)
+    n += kcache[i].nfree;
+  return n;
+}
+
+void
+kstat(struct iostat *st)
+{
+  int i;
+
+  st->kallocs = 0;
+  for(i = 0; i < NCPU; i++)
+    st->kallocs += kcache[i].allocs;
+  st->krefills = kmem.refills;
+  st->kdrains = kmem.drains;
+}
@@ -2,8 +2,11 @@
 #include "defs.h"
 #include "param.h"
 #include "spinlock.h"
+#include "mmu.h"
+#include "proc.h"
 #include "vfs.h"
 #include "buf.h"
+#include "file.h"
 #include "s5.h"
 
 // Simple logging that allows concurrent FS system calls.
@@ -16,154 +19,425 @@
 //
 // A system call should call begin_op()/end_op() to mark
 // its start and end. Usually begin_op() just increments
-// the count of in-progress FS system calls and returns.
-// But if it thinks the log is close to running out, it
-// sleeps until the last outstanding end_op() commits.
+// the count of in-progress FS system calls, reserves room
+// for the blocks the call may write and returns.  But if
+// the log is close to running out, it sleeps until the
+// transaction has been committed.  begin_op() reserves
+// MAXOPBLOCKS; a call that knows it writes fewer (or more,
+// up to LOGSIZE) blocks declares that with begin_opn().
+//
+// Commits are done by a flusher kernel thread per log, not
+// by end_op(), so one transaction groups the updates of
+// many system calls (group commit).  The flusher commits
+// once the transaction is LOGFLUSHTICKS old, the log is
+// close to full, or someone calls log_force() (fsync).  It
+// then keeps new system calls out until the outstanding ones
+// end.  end_op() returns without waiting for the disk, so
+// an update is only durable after the next commit.
+//
+// The log is a physical re-do log containing disk blocks,
+// used as a ring.  A commit appends the transaction's blocks
+// after the ones already in the ring and writes the header;
+// system calls can go on from there.  Installing the blocks
+// at their home locations (checkpointing) happens later, in
+// the flusher too, when the ring is half full, when it needs
+// room for a commit or when the log has been idle for a
+// while.  Until a block is installed its buffer stays B_DIRTY
+// so the cache never re-reads the stale home copy.
 //
-// The log is a physical re-do log containing disk blocks.
 // The on-disk log format:
-//   header block, containing block #s for block A, B, C, ...
-//   block A
-//   block B
-//   block C
+//   header blocks, containing the ring's tail and length and
+//     the home block # of each ring slot; the first one also
+//     holds the tail and length, and is written last
+//   slot 0
+//   slot 1
 //   ...
-// Log appends are synchronous.
-
-// Contents of the header block, used for both the on-disk header block
-// and to keep track in memory of logged block# before commit.
+// Log appends are synchronous, but the blocks of a commit are
+// queued for the disk together and waited for once.  The log
+// need not be contiguous: initlogmap() takes the disk block of
+// the header and of each slot, so a file system can keep its
+// log in a file.
+//
+// A file system may also log data blocks with log_write_data()
+// (ordered mode).  Their contents do not go into the log; they
+// are written to their home locations before the transaction
+// that holds the metadata pointing at them commits.
+
+// Contents of the header blocks, laid end to end: the committed
+// blocks not yet installed are in slots tail, tail+1, ... (mod
+// the ring size).
 struct logheader {
+  uint magic;
+  int tail;
+  int n;
+  int block[LOGBLOCKS];  // home block # of each slot
+};
+
+#define LOGMAGIC 0x6c6f6721  // "!gol"; anything else is an empty log
+#define LOGHDRMAX ((sizeof(struct logheader) + MINBSIZE-1) / MINBSIZE)
+#define LOGHASH 64           // absorption index buckets, a power of 2
+
+// Hashed index of the block #s of a list, for absorption.
+struct logindex {
+  short head[LOGHASH];   // 1 + first entry of each bucket, 0 if none
+  short next[LOGSIZE];   // 1 + next entry in the same bucket
+};
+
+// Logged blocks of the open transaction.  Logged buffers are
+// pinned in the cache with B_DIRTY, so the pointers stay good.
+struct logtrans {
   int n;
   int block[LOGSIZE];
+  struct buf *buf[LOGSIZE];
+  struct logindex idx;
+  int nd;                    // ordered data blocks
+  int dblock[LOGSIZE];
+  struct buf *dbuf[LOGSIZE];
+  struct logindex didx;
 };
 
-#define NLOG 3   // Max number of active logs
+#define NLOG NDEV   // Max number of active logs
 #define LOGENABLED 1
 
 struct log {
   struct spinlock lock;
   int start;
   int size;
+  int nslot;       // ring size, in blocks
+  int nhdr;        // header blocks
+  int bsize;
+  uint map[LOGHDRMAX+LOGBLOCKS]; // disk block of each header block and slot
+  char hdirty[LOGHDRMAX]; // header blocks changed by a commit
   int outstanding; // how many FS sys calls are executing.
+  int reserved;    // blocks they may still log
   int committing;  // in commit(), please wait.
+  int wantflush;   // flusher wants to commit, please wait.
+  uint since;      // ticks when the transaction got its first block
+  uint ncommit;    // number of commits done
+  uint lastcommit; // ticks at the last commit
+  struct proc *flusher;
+  void (*ringbusy)(int, int); // told when the ring starts/stops being used
+  int busy;        // ringbusy(dev, 1) called since recovery
   int dev;
   int flag;
-  struct logheader lh;
+  struct logtrans lh;   // open transaction
+  struct logheader ring; // only the flusher changes it
+  struct buf *rbuf[LOGBLOCKS]; // cached home buffer of each slot
+  struct buf io[LOGSIZE]; // home writes of a checkpoint
+  struct buf *iov[LOGSIZE];
+  struct buf *lbuf[LOGSIZE];
 };
 struct log log[NLOG];
 
-static void recover_from_log(void);
+static int recover_from_log(int);
 static void commit();
+static void logflusher(void*);
 
-void
-initlog(int dev)
+// Size dev's log for n disk blocks: the header blocks, then
+// the ring slots.
+static void
+logsize(int dev, int n)
 {
-  if (sizeof(struct logheader) >= BSIZE)
-    panic("initlog: too big logheader");
+  struct log *l = &log[dev];
+
+  l->bsize = sb[dev].blocksize;
+  l->nhdr = (sizeof(struct logheader) + l->bsize-1) / l->bsize;
+  l->size = n;
+  l->nslot = min(n - l->nhdr, LOGBLOCKS);
+  if (l->nslot < LOGSIZE)
+    panic("initlog: log too small");
+}
 
+// Recover dev's log and start its flusher.  Returns the
+// number of blocks recovery installed.
+static int
+logstart(int dev)
+{
   char devnum[3];
   itoa(dev, devnum);
   char logname[16];
+  int n;
 
   strconcat(logname, "log ", devnum);
 
-  struct superblock sb;
   initlock(&log[dev].lock, logname);
+  log[dev].start = log[dev].map[0];
+  log[dev].dev = dev;
+  log[dev].flag |= LOGENABLED;
+  n = recover_from_log(dev);
+
+  if(log[dev].flusher == 0 &&
+     (log[dev].flusher = kthread("logflush", logflusher, &log[dev])) == 0)
+    panic("initlog: no flusher");
+  return n;
+}
+
+// Set up the log of an s5 file system, which is contiguous.
+void
+initlog(int dev)
+{
+  struct superblock sb;
+  int i;
 
   s5_readsb(dev, &sb);
   struct s5_superblock *s5sb = sb.fs_info;
 
-  log[dev].start = s5sb->logstart;
-  log[dev].size = s5sb->nlog;
-  log[dev].dev = dev;
-  log[dev].flag |= LOGENABLED;
-  recover_from_log();
+  logsize(dev, s5sb->nlog);
+  for (i = 0; i < log[dev].nhdr + log[dev].nslot; i++)
+    log[dev].map[i] = s5sb->logstart + i;
+  logstart(dev);
+}
+
+// Set up ip's device's log in the blocks of file ip, from
+// block first on.  Recovers the log and returns the number
+// of blocks it installed, or -1 if ip is too small.
+// If ringbusy is not 0, it is called with 1 before the first
+// commit after recovery puts blocks into the ring, and with 0
+// once recovery has emptied the ring, so that the file system
+// can keep other systems out while the ring may hold blocks.
+// It is not called each time the ring drains, which would
+// cost two superblock writes per burst of commits.
+// Caller holds ip's lock.
+int
+initlogfile(struct inode *ip, uint first, void (*ringbusy)(int, int))
+{
+  struct log *l = &log[ip->dev];
+  int i, n;
+
+  n = ip->size / sb[ip->dev].blocksize - first;
+  if (n < (int)(sizeof(struct logheader) + sb[ip->dev].blocksize-1) /
+          sb[ip->dev].blocksize + LOGBLOCKS)
+    return -1;
+  logsize(ip->dev, n);
+  for (i = 0; i < l->nhdr + l->nslot; i++)
+    l->map[i] = ip->iops->bmap(ip, first + i);
+  l->ringbusy = ringbusy;
+  return logstart(ip->dev);
+}
+
+// Does dev have a log?
+int
+log_enabled(int dev)
+{
+  return dev >= 0 && dev < NLOG && (log[dev].flag & LOGENABLED);
+}
+
+// Blocks in the open transaction, counted against LOGSIZE.
+static int
+logused(struct log *l)
+{
+  return l->lh.n + l->lh.nd;
+}
+
+// Index of blockno in the list block[] indexed by x, or -1.
+static int
+logfind(struct logindex *x, int *block, int blockno)
+{
+  int i;
+
+  for (i = x->head[blockno & (LOGHASH-1)]; i != 0; i = x->next[i-1])
+    if (block[i-1] == blockno)
+      return i-1;
+  return -1;
 }
 
-// Copy committed blocks from log to their home location
+// Add entry i, for blockno, to index x.
 static void
-install_trans(int dev)
+logindex(struct logindex *x, int i, int blockno)
 {
-  int tail;
-  if (!log[dev].flag & LOGENABLED) return;
-
-  for (tail = 0; tail < log[dev].lh.n; tail++) {
-    struct buf *lbuf = bread(log[dev].dev, log[dev].start+tail+1); // read log block
-    struct buf *dbuf = bread(log[dev].dev, log[dev].lh.block[tail]); // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
-    brelse(lbuf);
-    brelse(dbuf);
+  short *h = &x->head[blockno & (LOGHASH-1)];
+
+  x->next[i] = *h;
+  *h = i+1;
+}
+
+// Is block blockno in ring entries from..ring.n-1?
+static int
+inring(struct log *l, int from, int blockno)
+{
+  int k;
+
+  for (k = from; k < l->ring.n; k++)
+    if (l->ring.block[(l->ring.tail + k) % l->nslot] == blockno)
+      return 1;
+  return 0;
+}
+
+// Is block blockno in the open transaction?  Caller holds l->lock.
+static int
+intrans(struct log *l, int blockno)
+{
+  return logfind(&l->lh.idx, l->lh.block, blockno) >= 0;
+}
+
+// Copy the oldest m committed blocks from the log to their
+// home locations, without going through their cached copies,
+// which may hold newer, uncommitted data.  Then let the
+// cache evict the blocks that are now the same as on disk.
+static void
+install_trans(struct log *l, int m, int recovering)
+{
+  int k, slot;
+  struct buf **lbuf = l->lbuf, **io = l->iov;
+
+  for (k = 0; k < m; k++) {
+    slot = (l->ring.tail + k) % l->nslot;
+    lbuf[k] = bread(l->dev, l->map[l->nhdr+slot]); // read log block
+    io[k] = &l->io[k];
+    memset(io[k], 0, sizeof(*io[k]));
+    io[k]->dev = l->dev;
+    io[k]->blockno = l->ring.block[slot];
+    io[k]->bsize = lbuf[k]->bsize;
+    io[k]->data = lbuf[k]->data;
+    io[k]->flags = B_BUSY | B_DIRTY;
+  }
+  iderwv(io, m);  // write dsts to disk
+  for (k = 0; k < m; k++)
+    brelse(lbuf[k]);
+  if (recovering)
+    return;
+
+  // Unpin blocks with no newer copy in the ring or the open
+  // transaction.  Holding the log lock keeps log_write() out.
+  for (k = 0; k < m; k++) {
+    slot = (l->ring.tail + k) % l->nslot;
+    if (inring(l, k+1, io[k]->blockno))
+      continue;
+    acquire(&l->lock);
+    if (!intrans(l, io[k]->blockno))
+      bunpin(l->rbuf[slot]);
+    release(&l->lock);
   }
 }
 
+// Bytes of the header kept in header block j.
+static int
+hdrbytes(struct log *l, int j)
+{
+  return min(l->bsize, sizeof(struct logheader) - j*l->bsize);
+}
+
 // Read the log header from disk into the in-memory log header
 static void
-read_head(int dev)
+read_head(struct log *l)
 {
-  if (!log[dev].flag & LOGENABLED) return;
+  struct buf *buf;
+  int j;
 
-  struct buf *buf = bread(log[dev].dev, log[dev].start);
-  struct logheader *lh = (struct logheader *) (buf->data);
-  int i;
-  log[dev].lh.n = lh->n;
-  for (i = 0; i < log[dev].lh.n; i++) {
-    log[dev].lh.block[i] = lh->block[i];
+  for (j = 0; j < l->nhdr; j++) {
+    buf = bread(l->dev, l->map[j]);
+    memmove((char*)&l->ring + j*l->bsize, buf->data, hdrbytes(l, j));
+    brelse(buf);
   }
-  brelse(buf);
 }
 
-// Write in-memory log header to disk.
+// Write in-memory log header to disk: the header blocks
+// marked in hdirty, then the first one.
 // This is the true point at which the
 // current transaction commits.
 static void
-write_head(int dev)
+write_head(struct log *l)
 {
-  if (!log[dev].flag & LOGENABLED) return;
-
-  struct buf *buf = bread(log[dev].dev, log[dev].start);
-  struct logheader *hb = (struct logheader *) (buf->data);
-  int i;
-  hb->n = log[dev].lh.n;
-  for (i = 0; i < log[dev].lh.n; i++) {
-    hb->block[i] = log[dev].lh.block[i];
+  struct buf *buf[LOGHDRMAX];
+  int j, n;
+
+  l->ring.magic = LOGMAGIC;
+  n = 0;
+  for (j = 1; j < l->nhdr; j++) {
+    if (!l->hdirty[j])
+      continue;
+    buf[n] = bread(l->dev, l->map[j]);
+    memmove(buf[n]->data, (char*)&l->ring + j*l->bsize, hdrbytes(l, j));
+    n++;
+    l->hdirty[j] = 0;
   }
-  bwrite(buf);
-  brelse(buf);
+  bwritev(buf, n);
+  for (j = 0; j < n; j++)
+    brelse(buf[j]);
+
+  buf[0] = bread(l->dev, l->map[0]);
+  memmove(buf[0]->data, &l->ring, hdrbytes(l, 0));
+  bwritev(buf, 1);  // not delayed, unlike bwrite()
+  brelse(buf[0]);
 }
 
+// Install the oldest committed blocks, at most LOGSIZE,
+// and free their slots.
 static void
-recover_from_log(void)
+checkpoint(struct log *l, int recovering)
 {
-  int i;
+  int m;
+
+  m = min(l->ring.n, LOGSIZE);
+  if (m == 0)
+    return;
+  install_trans(l, m, recovering);
+  l->ring.tail = (l->ring.tail + m) % l->nslot;
+  l->ring.n -= m;
+  write_head(l);
+}
 
-  for (i = 0; i < NLOG; i++) {
-    if (!log[i].flag & LOGENABLED) continue;
+static int
+recover_from_log(int dev)
+{
+  struct log *l = &log[dev];
+  int n;
 
-    read_head(i);
-    install_trans(i); // if committed, copy from log to disk
-    log[i].lh.n = 0;
-    write_head(i); // clear the log
+  read_head(l);
+  if (l->ring.magic != LOGMAGIC ||
+      l->ring.tail < 0 || l->ring.tail >= l->nslot ||
+      l->ring.n < 0 || l->ring.n > l->nslot) {
+    // not a ring header; an empty log
+    l->ring.tail = 0;
+    l->ring.n = 0;
   }
+  n = l->ring.n;
+  while (l->ring.n > 0)
+    checkpoint(l, 1); // if committed, copy from log to disk
+  l->ring.tail = 0;
+  memset(l->hdirty, 1, sizeof(l->hdirty));
+  write_head(l); // clear the log
+  if (l->ringbusy)
+    l->ringbusy(dev, 0);
+  l->busy = 0;
+  return n;
 }
 
 // called at the start of each FS system call.
 void
 begin_op(void)
+{
+  begin_opn(MAXOPBLOCKS);
+}
+
+// called at the start of an FS system call that logs at
+// most need blocks.
+void
+begin_opn(int need)
 {
   int i;
 
+  if(need < 1 || need > LOGSIZE)
+    panic("begin_opn");
+  proc->logneed = need;
+
   for (i = 0; i < NLOG; i++) {
     if (!log[i].flag & LOGENABLED) continue;
 
     acquire(&log[i].lock);
     while(1){
-      if(log[i].committing){
+      if(log[i].committing || log[i].wantflush){
         sleep(&log[i], &log[i].lock);
-      } else if(log[i].lh.n + (log[i].outstanding+1)*MAXOPBLOCKS > LOGSIZE){
+      } else if(logused(&log[i]) + log[i].reserved + need > LOGSIZE){
         // this op might exhaust log space; wait for commit.
+        if(logused(&log[i]) > 0){
+          log[i].wantflush = 1;
+          wakeup(&log[i].lh);
+        }
         sleep(&log[i], &log[i].lock);
       } else {
         log[i].outstanding += 1;
+        log[i].reserved += need;
         release(&log[i].lock);
         break;
       }
@@ -172,7 +446,7 @@ begin_op(void)
 }
 
 // called at the end of each FS system call.
-// commits if this was the last outstanding operation.
+// The flusher commits the transaction later.
 void
 end_op(void)
 {
@@ -181,60 +455,191 @@ end_op(void)
   for (i = 0; i < NLOG; i++) {
     if (!log[i].flag & LOGENABLED) continue;
 
-    int do_commit = 0;
-
     acquire(&log[i].lock);
     log[i].outstanding -= 1;
+    log[i].reserved -= proc->logneed;
     if(log[i].committing)
       panic("log.committing");
-    if(log[i].outstanding == 0){
-      do_commit = 1;
-      log[i].committing = 1;
-    } else {
-      // begin_op() may be waiting for log space.
-      wakeup(&log[i]);
+    if(logused(&log[i]) + MAXOPBLOCKS > LOGSIZE && !log[i].wantflush){
+      // the next op might not fit; commit soon.
+      log[i].wantflush = 1;
+      wakeup(&log[i].lh);
     }
+    // begin_op() may be waiting for log space,
+    // and the flusher for outstanding ops to end.
+    wakeup(&log[i]);
     release(&log[i].lock);
+  }
+}
+
+// Is it time to commit?  Caller holds l->lock.
+static int
+commitready(struct log *l)
+{
+  return logused(l) > 0 &&
+    (l->wantflush || ticks - l->since >= LOGFLUSHTICKS);
+}
+
+// Is it time to checkpoint?
+static int
+ckptready(struct log *l)
+{
+  return l->ring.n > 0 &&
+    (l->ring.n * 2 >= l->nslot || ticks - l->lastcommit >= LOGFLUSHTICKS);
+}
 
-    if(do_commit){
-      // call commit w/o holding locks, since not allowed
-      // to sleep with locks.
-      commit(i);
-      acquire(&log[i].lock);
-      log[i].committing = 0;
-      wakeup(&log[i]);
-      release(&log[i].lock);
+// The flusher thread of log l.  Sleeps on &l->lh until
+// there is a transaction to commit or blocks to install.
+static void
+logflusher(void *arg)
+{
+  struct log *l = arg;
+
+  for(;;){
+    acquire(&l->lock);
+    while(!commitready(l) && !ckptready(l)){
+      if(l->wantflush){
+        // nothing to commit after all
+        l->wantflush = 0;
+        wakeup(l);
+      }
+      sleep(&l->lh, &l->lock);
     }
+
+    if(!commitready(l)){
+      // Install some blocks while system calls go on.
+      release(&l->lock);
+      checkpoint(l, 0);
+      continue;
+    }
+
+    // Keep new ops out and wait for the current ones.
+    l->wantflush = 1;
+    while(l->outstanding > 0)
+      sleep(l, &l->lock);
+    l->committing = 1;
+    l->wantflush = 0;
+    release(&l->lock);
+
+    // call commit w/o holding locks, since not allowed
+    // to sleep with locks.
+    while(l->nslot - l->ring.n < l->lh.n)
+      checkpoint(l, 0);  // make room in the ring
+    commit(l);
+
+    acquire(&l->lock);
+    l->committing = 0;
+    l->ncommit++;
+    l->lastcommit = ticks;
+    wakeup(l);
+    release(&l->lock);
   }
 }
 
-// Copy modified blocks from cache to log.
-static void
-write_log(int dev)
+// Called on every clock tick: wake the flusher of any log
+// with a transaction old enough to commit or an idle ring
+// to install.
+void
+logtimer(void)
 {
-  int tail;
+  struct log *l;
+
+  for(l = log; l < &log[NLOG]; l++){
+    if(l->flusher == 0 || l->committing || l->wantflush)
+      continue;
+    if((logused(l) > 0 && ticks - l->since >= LOGFLUSHTICKS) ||
+       (l->ring.n > 0 && ticks - l->lastcommit >= LOGFLUSHTICKS))
+      wakeup(&l->lh);
+  }
+}
+
+// Wait until every op that has ended on dev's log is on disk.
+void
+log_force(int dev)
+{
+  struct log *l;
+  uint n;
+
+  if(!log_enabled(dev))
+    return;
+  l = &log[dev];
+  acquire(&l->lock);
+  if(logused(l) > 0 || l->committing){
+    // The transaction now open or committing has them.
+    n = l->ncommit;
+    if(!l->committing){
+      l->wantflush = 1;
+      wakeup(&l->lh);
+    }
+    while(l->ncommit == n)
+      sleep(l, &l->lock);
+  }
+  release(&l->lock);
+}
 
-  if (!log[dev].flag & LOGENABLED) return;
+// Write the ordered data blocks of the transaction to their
+// home locations and unpin them.  No op is running, so nobody
+// changes the buffers while they are written from.
+static void
+write_data(struct log *l)
+{
+  int k;
+  struct buf **io = l->iov, *b;
+
+  for (k = 0; k < l->lh.nd; k++) {
+    b = l->lh.dbuf[k];
+    io[k] = &l->io[k];
+    memset(io[k], 0, sizeof(*io[k]));
+    io[k]->dev = b->dev;
+    io[k]->blockno = b->blockno;
+    io[k]->bsize = b->bsize;
+    io[k]->data = b->data;
+    io[k]->flags = B_BUSY | B_DIRTY;
+  }
+  iderwv(io, l->lh.nd);
+  for (k = 0; k < l->lh.nd; k++)
+    if (!intrans(l, io[k]->blockno) && !inring(l, 0, io[k]->blockno))
+      bunpin(l->lh.dbuf[k]);
+  l->lh.nd = 0;
+  memset(l->lh.didx.head, 0, sizeof(l->lh.didx.head));
+}
 
-  for (tail = 0; tail < log[dev].lh.n; tail++) {
-    struct buf *to = bread(log[dev].dev, log[dev].start+tail+1); // log block
-    struct buf *from = bread(log[dev].dev, log[dev].lh.block[tail]); // cache block
-    memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
-    brelse(from);
-    brelse(to);
+// Copy modified blocks from cache to the free slots after
+// the ring's head.
+static void
+write_log(struct log *l)
+{
+  int k, slot;
+  struct buf **to = l->iov;
+
+  for (k = 0; k < l->lh.n; k++) {
+    slot = (l->ring.tail + l->ring.n + k) % l->nslot;
+    to[k] = bread(l->dev, l->map[l->nhdr+slot]); // log block
+    memmove(to[k]->data, l->lh.buf[k]->data, to[k]->bsize);
+    l->ring.block[slot] = l->lh.block[k];
+    l->rbuf[slot] = l->lh.buf[k];
+    l->hdirty[(int)(sizeof(struct logheader) - sizeof(l->ring.block) +
+                    slot*sizeof(int)) / l->bsize] = 1;
   }
+  bwritev(to, l->lh.n);  // write the log, all blocks queued at once
+  for (k = 0; k < l->lh.n; k++)
+    brelse(to[k]);
 }
 
 static void
-commit(int dev)
+commit(struct log *l)
 {
-  if (log[dev].lh.n > 0) {
-    write_log(dev);     // Write modified blocks from cache to log
-    write_head(dev);    // Write header to disk -- the real commit
-    install_trans(dev); // Now install writes to home locations
-    log[dev].lh.n = 0;
-    write_head(dev);    // Erase the transaction from the log
+  if (l->lh.nd > 0)
+    write_data(l);      // Ordered data goes home first
+  if (l->lh.n > 0) {
+    if (!l->busy && l->ringbusy)
+      l->ringbusy(l->dev, 1); // Before anything is in the ring
+    l->busy = 1;
+    write_log(l);       // Write modified blocks from cache to log
+    l->ring.n += l->lh.n;
+    write_head(l);      // Write header to disk -- the real commit
+    l->lh.n = 0;        // Blocks stay pinned until installed
+    memset(l->lh.idx.head, 0, sizeof(l->lh.idx.head));
   }
 }
 
@@ -254,20 +659,55 @@ log_write(struct buf *b)
 
   if (!log[b->dev].flag & LOGENABLED) return;
 
-  if (log[b->dev].lh.n >= LOGSIZE || log[b->dev].lh.n >= log[b->dev].size - 1)
+  if (logused(&log[b->dev]) >= LOGSIZE)
     panic("too big a transaction");
   if (log[b->dev].outstanding < 1)
     panic("log_write outside of trans");
 
   acquire(&log[b->dev].lock);
-  for (i = 0; i < log[b->dev].lh.n; i++) {
-    if (log[b->dev].lh.block[i] == b->blockno)   // log absorbtion
-      break;
+  i = logfind(&log[b->dev].lh.idx, log[b->dev].lh.block, b->blockno);
+  if (i < 0) {   // not absorbed
+    i = log[b->dev].lh.n++;
+    log[b->dev].lh.block[i] = b->blockno;
+    logindex(&log[b->dev].lh.idx, i, b->blockno);
   }
-  log[b->dev].lh.block[i] = b->blockno;
-  if (i == log[b->dev].lh.n)
-    log[b->dev].lh.n++;
+  log[b->dev].lh.buf[i] = b;
+  if (logused(&log[b->dev]) == 1)
+    log[b->dev].since = ticks;
+  b->unpin = 0;        // pinned again; cancel a pending bunpin()
   b->flags |= B_DIRTY; // prevent eviction
   release(&log[b->dev].lock);
 }
 
+// Caller has modified the data block b of a file.  Like
+// log_write(), but the block does not go into the log; it
+// is written in place just before the transaction commits,
+// so the metadata that points at it never refers to stale
+// contents after a crash.
+void
+log_write_data(struct buf *b)
+{
+  struct log *l = &log[b->dev];
+  int i;
+
+  if (!log_enabled(b->dev))
+    panic("log_write_data: no log");
+  if (logused(l) >= LOGSIZE)
+    panic("too big a transaction");
+  if (l->outstanding < 1)
+    panic("log_write_data outside of trans");
+
+  acquire(&l->lock);
+  i = logfind(&l->lh.didx, l->lh.dblock, b->blockno);
+  if (i < 0) {
+    i = l->lh.nd++;
+    l->lh.dblock[i] = b->blockno;
+    logindex(&l->lh.didx, i, b->blockno);
+  }
+  l->lh.dbuf[i] = b;
+  if (logused(l) == 1)
+    l->since = ticks;
+  b->unpin = 0;        // pinned again; cancel a pending bunpin()
+  b->flags |= B_DIRTY; // prevent eviction
+  release(&l->lock);
+}
@@ -31,8 +31,11 @@ main(void)
   uartinit();      // serial port
   pinit();         // process table
   tvinit();        // trap vectors
+  kmeminit();      // kernel object caches
   binit();         // buffer cache
+  dinit();         // directory entry cache
   fileinit();      // file table
+  pipeinit();      // pipe buffers
   initvfssw();     // vfs table init
   initvfsmlist();  // Init the vfs list
   mountinit();     // mount table
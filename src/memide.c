@@ -12,11 +12,13 @@
 #include "vfs.h"
 #include "buf.h"
 #include "s5.h"
+#include "iostat.h"
 
 extern uchar _binary_fs_img_start[], _binary_fs_img_size[];
 
 static int disksize;
 static uchar *memdisk;
+static uint ioreqs;
 
 void
 ideinit(void)
@@ -27,7 +29,7 @@ ideinit(void)
 
 // Interrupt handler.
 void
-ideintr(void)
+ideintr(int secflag)
 {
   // no-op
 }
@@ -50,6 +52,7 @@ iderw(struct buf *b)
     panic("iderw: block out of range");
 
   p = memdisk + b->blockno*BSIZE;
+  ioreqs++;
   
   if(b->flags & B_DIRTY){
     b->flags &= ~B_DIRTY;
@@ -58,3 +61,54 @@ iderw(struct buf *b)
     memmove(b->data, p, BSIZE);
   b->flags |= B_VALID;
 }
+
+// The memory disk finishes every request at once, so
+// submitting is the same as syncing; see ide.c.
+void
+idesubmit(struct buf *b)
+{
+  void (*iodone)(struct buf*);
+
+  iodone = b->iodone;
+  b->iodone = 0;
+  iderw(b);
+  if(iodone)
+    iodone(b);
+}
+
+void
+idesubmitv(struct buf **bv, int n)
+{
+  int i;
+
+  for(i = 0; i < n; i++)
+    idesubmit(bv[i]);
+}
+
+void
+ideiowait(struct buf *b)
+{
+}
+
+void
+iderwv(struct buf **bv, int n)
+{
+  int i;
+
+  for(i = 0; i < n; i++)
+    iderw(bv[i]);
+}
+
+void
+idestat(struct iostat *st)
+{
+  st->ioreqs = ioreqs;
+  st->iomerged = 0;
+}
+
+// No DMA here.
+int
+idedma(int on)
+{
+  return -1;
+}
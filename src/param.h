@@ -3,17 +3,29 @@
 #define NCPU          8  // maximum number of CPUs
 #define NOFILE       16  // open files per process
 #define NFILE       100  // open files per system
-#define NINODE       50  // maximum number of active i-nodes
+#define NINODE       1000  // maximum number of cached i-nodes
 #define NDEV         10  // maximum major device number
 #define MAXBDEV       4  // maximum numbers of block devices
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
+#define NVMSEG        4  // program segments exec loads on demand
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
-#define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
-#define FSSIZE       1000  // size of file system in blocks
+#define DIROPBLOCKS  (MAXOPBLOCKS*2)  // ... one that adds a name (index split)
+#define LOGSIZE      (MAXOPBLOCKS*12)  // max blocks in one log transaction
+#define LOGFLUSHTICKS 10  // max age of a log transaction before commit
+#define LOGBLOCKS    (LOGSIZE*4)  // slots in the on-disk log ring
+#define NBUF         (MAXOPBLOCKS*3)  // min pages in disk block cache
+#define PGLOWAT      512   // free pages below which the block cache shrinks
+#define PGHIWAT      1024  // free pages above which the block cache grows
+#define KBATCH       32   // pages moved between a CPU's page cache and the global list
+#define NBUCKET      251  // hash buckets in the disk block cache
+#define RAMIN        4    // initial read-ahead window, in blocks
+#define RAMAX        32   // max read-ahead window, in blocks
+#define WBTICKS      100  // age at which a delayed write goes to disk
+#define FSSIZE       4000  // size of file system in blocks
 #define MAXVFSSIZE   4  // size of file system in blocks
 #define IDEMAJOR     0  // IDE major block device
 #define ROOTFSTYPE   "s5"
 #define MAXBSIZE     4096 // The Maximum BSIZE
+#define MINBSIZE     512  // The Minimum BSIZE
 
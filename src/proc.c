@@ -104,19 +104,34 @@ userinit(void)
 }
 
 // Grow current process's memory by n bytes.
+// Growing only reserves the address space; pgfault() fills
+// the pages in with zeroes as they are first touched.
+// Shrinking frees the pages at once.
 // Return 0 on success, -1 on failure.
 int
 growproc(int n)
 {
+  struct vmseg *s;
   uint sz;
   
   sz = proc->sz;
   if(n > 0){
-    if((sz = allocuvm(proc->pgdir, sz, sz + n)) == 0)
+    if(sz + n < sz || sz + n >= KERNBASE)
       return -1;
+    sz += n;
   } else if(n < 0){
     if((sz = deallocuvm(proc->pgdir, sz, sz + n)) == 0)
       return -1;
+    // Memory given back comes back zeroed if the process
+    // grows again, not paged in from the program file.
+    for(s = proc->seg; s < &proc->seg[proc->nseg]; s++){
+      if(s->end > PGROUNDUP(sz))
+        s->end = PGROUNDUP(sz);
+      if(s->end < s->va)
+        s->end = s->va;
+      if(s->filesz > s->end - s->va)
+        s->filesz = s->end - s->va;
+    }
   }
   proc->sz = sz;
   switchuvm(proc);
@@ -154,6 +169,10 @@ fork(void)
     if(proc->ofile[i])
       np->ofile[i] = filedup(proc->ofile[i]);
   np->cwd = idup(proc->cwd);
+  if(proc->execip)
+    np->execip = idup(proc->execip);
+  np->nseg = proc->nseg;
+  memmove(np->seg, proc->seg, sizeof(proc->seg));
 
   safestrcpy(np->name, proc->name, sizeof(proc->name));
  
@@ -189,8 +208,12 @@ exit(void)
 
   begin_op();
   iput(proc->cwd);
+  if(proc->execip)
+    iput(proc->execip);
   end_op();
   proc->cwd = 0;
+  proc->execip = 0;
+  proc->nseg = 0;
 
   acquire(&ptable.lock);
 
@@ -342,11 +365,62 @@ forkret(void)
     first = 0;
     iinit(ROOTDEV);
     initlog(ROOTDEV); // TODO: Decouple this
+    bwbinit(ROOTDEV);
   }
 
   // Return to "caller", actually trapret (see allocproc).
 }
 
+// A kernel thread's very first scheduling by scheduler()
+// will swtch here, with fn and arg on the stack (see kthread).
+static void
+kthreadret(void (*fn)(void*), void *arg)
+{
+  // Still holding ptable.lock from scheduler.
+  release(&ptable.lock);
+  fn(arg);
+  panic("kthread returned");
+}
+
+// Create a kernel thread running fn(arg).  It has no user
+// memory and never returns to user space; fn must not return.
+struct proc*
+kthread(char *name, void (*fn)(void*), void *arg)
+{
+  struct proc *p;
+  char *sp;
+
+  if((p = allocproc()) == 0)
+    return 0;
+  if((p->pgdir = setupkvm()) == 0){
+    kfree(p->kstack);
+    p->kstack = 0;
+    p->state = UNUSED;
+    return 0;
+  }
+
+  // Arguments and a fake return PC for kthreadret.
+  sp = p->kstack + KSTACKSIZE;
+  sp -= 4;
+  *(uint*)sp = (uint)arg;
+  sp -= 4;
+  *(uint*)sp = (uint)fn;
+  sp -= 4;
+  *(uint*)sp = 0;
+
+  sp -= sizeof *p->context;
+  p->context = (struct context*)sp;
+  memset(p->context, 0, sizeof *p->context);
+  p->context->eip = (uint)kthreadret;
+  p->tf = 0;
+
+  safestrcpy(p->name, name, sizeof(p->name));
+  acquire(&ptable.lock);
+  p->state = RUNNABLE;
+  release(&ptable.lock);
+  return p;
+}
+
 // Atomically release lock and sleep on chan.
 // Reacquires lock when awakened.
 void
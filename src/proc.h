@@ -52,6 +52,15 @@ struct context {
 enum procstate { UNUSED, EMBRYO, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
 // Per-process state
+// Part of a program file that exec mapped without reading;
+// pgfault() reads its pages in on first touch.
+struct vmseg {
+  uint va;                     // First address, page aligned
+  uint end;                    // End in memory (va + memsz)
+  uint off;                    // File offset of va
+  uint filesz;                 // Bytes from the file; the rest is zero
+};
+
 struct proc {
   uint sz;                     // Size of process memory (bytes)
   pde_t* pgdir;                // Page table
@@ -66,6 +75,10 @@ struct proc {
   struct file *ofile[NOFILE];  // Open files
   struct inode *cwd;           // Current directory
   char name[16];               // Process name (debugging)
+  int logneed;                 // Log blocks reserved by begin_opn()
+  struct inode *execip;        // Program file, for demand paging
+  struct vmseg seg[NVMSEG];    // Segments still paged in from execip
+  int nseg;
 };
 
 // Process memory is laid out contiguously, low addresses first:
@@ -0,0 +1,75 @@
+// Measure sequential read-ahead.
+//
+// usage: rabench file [bufsize]
+//
+// Reads file front to back twice, bufsize bytes at a time.
+// The first pass only shows read-ahead at work if the file
+// is not cached yet: use a big file nobody has read since
+// boot, e.g. rabench usertests on fs.img, or a large file
+// on a mounted ext2.img.  The second pass runs from the
+// cache.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "fcntl.h"
+#include "iostat.h"
+
+char buf[4096];
+
+int
+seqread(char *path, int bsize)
+{
+  int fd, n, tot;
+
+  if((fd = open(path, O_RDONLY)) < 0){
+    printf(1, "rabench: cannot open %s\n", path);
+    exit();
+  }
+  tot = 0;
+  while((n = read(fd, buf, bsize)) > 0)
+    tot += n;
+  close(fd);
+  return tot;
+}
+
+void
+pass(char *what, char *path, int bsize)
+{
+  struct iostat s0, s1;
+  int n, t;
+
+  iostat(&s0);
+  t = uptime();
+  n = seqread(path, bsize);
+  t = uptime() - t;
+  iostat(&s1);
+  printf(1, "%s: %d bytes in %d ticks", what, n, t);
+  if(t > 0)
+    printf(1, " (%d KB/s)", n / 1024 * 100 / t);
+  printf(1, ", %d misses, %d read ahead, %d read-ahead hits\n",
+         s1.misses - s0.misses, s1.raissued - s0.raissued,
+         s1.rahits - s0.rahits);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int bsize;
+
+  if(argc < 2){
+    printf(2, "usage: rabench file [bufsize]\n");
+    exit();
+  }
+  bsize = 512;
+  if(argc > 2)
+    bsize = atoi(argv[2]);
+  if(bsize <= 0 || bsize > sizeof(buf)){
+    printf(2, "rabench: bufsize must be 1..%d\n", sizeof(buf));
+    exit();
+  }
+
+  pass("cold", argv[1], bsize);
+  pass("warm", argv[1], bsize);
+  exit();
+}
@@ -12,58 +12,34 @@
 #include "file.h"
 #include "vfsmount.h"
 #include "s5.h"
+#include "find_bits.h"
+#include "slab.h"
 
-/*
- * Its is a pool to allocate s5 inodes structs.
- * We use it becase we don't have a kmalloc function.
- * With an kmalloc implementatios, it need to be removed.
- */
-static struct {
-  struct spinlock lock;
-  struct s5_inode s5_i_entry[NINODE];
-} s5_inode_pool;
+// In-memory s5 inodes come from their own slab cache and
+// are kept zeroed while free; s5_cleanup() zeroes them again
+// before giving them back.
+static struct kmem_cache s5_inode_cache;
+
+static void
+s5_inode_ctor(void *v)
+{
+  memset(v, 0, sizeof(struct s5_inode));
+}
 
 struct s5_inode*
 alloc_s5_inode()
 {
-  struct s5_inode *ip;
-
-  acquire(&s5_inode_pool.lock);
-  for (ip = &s5_inode_pool.s5_i_entry[0]; ip < &s5_inode_pool.s5_i_entry[NINODE]; ip++) {
-    if (ip->flag == S5_INODE_FREE) {
-      ip->flag |= S5_INODE_USED;
-      release(&s5_inode_pool.lock);
-
-      return ip;
-    }
-  }
-  release(&s5_inode_pool.lock);
-
-  return 0;
+  return kmem_cache_alloc(&s5_inode_cache);
 }
 
-static struct {
-  struct spinlock lock;
-  struct s5_superblock sb[MAXVFSSIZE];
-} s5_sb_pool; // It is a Pool of S5 Superblock Filesystems
-
 struct s5_superblock*
 alloc_s5_sb()
 {
   struct s5_superblock *sb;
 
-  acquire(&s5_sb_pool.lock);
-  for (sb = &s5_sb_pool.sb[0]; sb < &s5_sb_pool.sb[MAXVFSSIZE]; sb++) {
-    if (sb->flags == S5_SB_FREE) {
-      sb->flags |= S5_SB_USED;
-      release(&s5_sb_pool.lock);
-
-      return sb;
-    }
-  }
-  release(&s5_sb_pool.lock);
-
-  return 0;
+  if ((sb = kmalloc(sizeof(*sb))) != 0)
+    memset(sb, 0, sizeof(*sb));
+  return sb;
 }
 
 struct vfs_operations s5_ops = {
@@ -88,6 +64,7 @@ struct inode_operations s5_iops = {
   .itrunc     = &s5_itrunc,
   .cleanup    = &s5_cleanup,
   .bmap       = &s5_bmap,
+  .blookup    = &s5_blookup,
   .ilock      = &s5_ilock,
   .iunlock    = &generic_iunlock,
   .stati      = &generic_stati,
@@ -107,8 +84,7 @@ struct filesystem_type s5fs = {
 int
 inits5fs(void)
 {
-  initlock(&s5_sb_pool.lock, "s5_sb_pool");
-  initlock(&s5_inode_pool.lock, "s5_inode_pool");
+  kmem_cache_init(&s5_inode_cache, "s5_inode", sizeof(struct s5_inode), s5_inode_ctor);
   return register_fs(&s5fs);
 }
 
@@ -180,6 +156,8 @@ s5_readsb(int dev, struct superblock *sb)
 
   if((sb->flags & SB_NOT_LOADED) == 0) {
     s5sb = alloc_s5_sb(); // Allocate a new S5 sb struct to the superblock.
+    if (s5sb == 0)
+      panic("No memory for the s5 superblock");
   } else{
     s5sb = sb->fs_info;
   }
@@ -224,7 +202,7 @@ s5_ialloc(uint dev, short type)
 uint
 s5_balloc(uint dev)
 {
-  int b, bi, m;
+  int b, bi, m, n;
   struct buf *bp;
   struct s5_superblock *s5sb;
 
@@ -232,15 +210,17 @@ s5_balloc(uint dev)
   bp = 0;
   for (b = 0; b < s5sb->size; b += BPB) {
     bp = s5_ops.bread(dev, BBLOCK(b, (*s5sb)));
-    for (bi = 0; bi < BPB && b + bi < s5sb->size; bi++) {
+    n = BPB;
+    if (n > s5sb->size - b)
+      n = s5sb->size - b;
+    bi = find_next_zero_bit((unsigned long *)bp->data, n, 0);
+    if (bi < n) {  // Is a block free?
       m = 1 << (bi % 8);
-      if ((bp->data[bi/8] & m) == 0) {  // Is block free?
-        bp->data[bi/8] |= m;  // Mark block in use.
-        log_write(bp);
-        s5_ops.brelse(bp);
-        s5_ops.bzero(dev, b + bi);
-        return b + bi;
-      }
+      bp->data[bi/8] |= m;  // Mark block in use.
+      log_write(bp);
+      s5_ops.brelse(bp);
+      s5_ops.bzero(dev, b + bi);
+      return b + bi;
     }
     s5_ops.brelse(bp);
   }
@@ -362,6 +342,8 @@ void
 s5_cleanup(struct inode *ip)
 {
   memset(ip->i_private, 0, sizeof(struct s5_inode));
+  kmem_cache_free(&s5_inode_cache, ip->i_private);
+  ip->i_private = 0;
 }
 
 uint
@@ -397,6 +379,33 @@ s5_bmap(struct inode *ip, uint bn)
   panic("bmap: out of range");
 }
 
+// Like s5_bmap(), but returns 0 for a block that is not
+// allocated instead of allocating it.
+uint
+s5_blookup(struct inode *ip, uint bn)
+{
+  uint addr;
+  struct buf *bp;
+  struct s5_inode *s5ip;
+
+  s5ip = ip->i_private;
+
+  if(bn < NDIRECT)
+    return s5ip->addrs[bn];
+  bn -= NDIRECT;
+
+  if(bn < NINDIRECT){
+    if((addr = s5ip->addrs[NDIRECT]) == 0)
+      return 0;
+    bp = s5_ops.bread(ip->dev, addr);
+    addr = ((uint*)bp->data)[bn];
+    s5_ops.brelse(bp);
+    return addr;
+  }
+
+  panic("bmap: out of range");
+}
+
 void
 s5_ilock(struct inode *ip)
 {
@@ -405,18 +414,13 @@ s5_ilock(struct inode *ip)
   struct s5_superblock *s5sb;
   struct s5_inode *s5ip;
 
-  s5ip = ip->i_private;
-
   s5sb = sb[ip->dev].fs_info;
 
   if(ip == 0 || ip->ref < 1)
     panic("ilock");
 
-  acquire(&icache.lock);
-  while (ip->flags & I_BUSY)
-    sleep(ip, &icache.lock);
-  ip->flags |= I_BUSY;
-  release(&icache.lock);
+  acquiresleep(&ip->lock);
+  s5ip = ip->i_private;  // set up by iget() under the lock
 
   if (!(ip->flags & I_VALID)) {
     bp = s5_ops.bread(ip->dev, IBLOCK(ip->inum, (*s5sb)));
@@ -437,7 +441,7 @@ s5_ilock(struct inode *ip)
 int
 s5_readi(struct inode *ip, char *dst, uint off, uint n)
 {
-  uint tot, m;
+  uint tot, m, addr;
   struct buf *bp;
 
   if(ip->type == T_DEV){
@@ -452,8 +456,12 @@ s5_readi(struct inode *ip, char *dst, uint off, uint n)
     n = ip->size - off;
 
   for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
-    bp = ip->fs_t->ops->bread(ip->dev, ip->iops->bmap(ip, off/BSIZE));
     m = min(n - tot, BSIZE - off%BSIZE);
+    if((addr = s5_iops.blookup(ip, off/BSIZE)) == 0){
+      memset(dst, 0, m);
+      continue;
+    }
+    bp = ip->fs_t->ops->bread(ip->dev, addr);
     memmove(dst, bp->data + off%BSIZE, m);
     ip->fs_t->ops->brelse(bp);
   }
@@ -85,6 +85,7 @@ void           s5_iupdate(struct inode *ip);
 void           s5_itrunc(struct inode *ip);
 void           s5_cleanup(struct inode *ip);
 uint           s5_bmap(struct inode *ip, uint bn);
+uint           s5_blookup(struct inode *ip, uint bn);
 void           s5_ilock(struct inode* ip);
 void           s5_iunlock(struct inode* ip);
 void           s5_stati(struct inode *ip, struct stat *st);
@@ -0,0 +1,233 @@
+// Slab allocator for kernel objects.
+//
+// Each cache hands out objects of one size.  A slab is one
+// page from kalloc(): a header, a stack of free object
+// indexes, then the objects themselves, so the objects are
+// left untouched while free and the slab of an object is
+// found by rounding its address down to the page.
+//
+// In front of the slabs every CPU has a magazine of free
+// objects, used with interrupts off.  An empty magazine is
+// refilled, and a full one half emptied, under the cache
+// lock.  A slab that becomes empty goes back to kalloc()
+// unless it is the only one the cache has left.
+//
+// kmalloc() and kmfree() serve objects nobody made a cache
+// for from a set of power-of-two caches.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "mmu.h"
+#include "proc.h"
+#include "spinlock.h"
+#include "slab.h"
+
+struct slab {
+  struct kmem_cache *cache;
+  struct slab *next;      // On cache->partial
+  struct slab *prev;
+  ushort inuse;           // Objects handed out
+  ushort nfree;           // Entries in free[]
+  ushort free[];          // Indexes of the free objects
+};
+
+#define KMMIN  32    // smallest kmalloc() size
+#define NKMCACHE 7   // kmalloc() sizes 32 .. 2048
+
+static struct kmem_cache kmcache[NKMCACHE];
+static char *kmnames[NKMCACHE] = {
+  "kmalloc-32", "kmalloc-64", "kmalloc-128", "kmalloc-256",
+  "kmalloc-512", "kmalloc-1024", "kmalloc-2048",
+};
+
+void
+kmem_cache_init(struct kmem_cache *c, char *name, uint size, void (*ctor)(void*))
+{
+  uint n;
+
+  memset(c, 0, sizeof(*c));
+  initlock(&c->lock, name);
+  c->name = name;
+  c->size = (size + 7) & ~7;
+  c->ctor = ctor;
+  n = (PGSIZE - sizeof(struct slab)) / (c->size + sizeof(ushort));
+  for(; n > 0; n--){
+    c->off = (sizeof(struct slab) + n*sizeof(ushort) + 7) & ~7;
+    if(c->off + n*c->size <= PGSIZE)
+      break;
+  }
+  if(n == 0)
+    panic("kmem_cache_init: object too big");
+  c->perslab = n;
+}
+
+static void*
+slabobj(struct kmem_cache *c, struct slab *s, int i)
+{
+  return (char*)s + c->off + i*c->size;
+}
+
+static void
+partialadd(struct kmem_cache *c, struct slab *s)
+{
+  s->prev = 0;
+  s->next = c->partial;
+  if(c->partial)
+    c->partial->prev = s;
+  c->partial = s;
+}
+
+static void
+partialremove(struct kmem_cache *c, struct slab *s)
+{
+  if(s->prev)
+    s->prev->next = s->next;
+  else
+    c->partial = s->next;
+  if(s->next)
+    s->next->prev = s->prev;
+}
+
+// Add a fresh slab to c.  Caller holds c->lock, which is
+// dropped while kalloc() runs.  Returns 0 if out of memory.
+static int
+slabgrow(struct kmem_cache *c)
+{
+  struct slab *s;
+  int i;
+
+  release(&c->lock);
+  s = (struct slab*)kalloc();
+  if(s != 0){
+    s->cache = c;
+    s->inuse = 0;
+    s->nfree = c->perslab;
+    for(i = 0; i < c->perslab; i++){
+      s->free[i] = c->perslab - 1 - i;
+      if(c->ctor)
+        c->ctor(slabobj(c, s, i));
+    }
+  }
+  acquire(&c->lock);
+  if(s == 0)
+    return 0;
+  c->nslabs++;
+  partialadd(c, s);
+  return 1;
+}
+
+// Take an object from a partial slab.  Caller holds c->lock
+// and has made sure c->partial is not empty.
+static void*
+slabtake(struct kmem_cache *c)
+{
+  struct slab *s;
+
+  s = c->partial;
+  s->inuse++;
+  if(--s->nfree == 0)
+    partialremove(c, s);
+  return slabobj(c, s, s->free[s->nfree]);
+}
+
+// Return an object to its slab.  Caller holds c->lock.
+static void
+slabput(struct kmem_cache *c, void *v)
+{
+  struct slab *s;
+
+  s = (struct slab*)PGROUNDDOWN((uint)v);
+  if(s->cache != c)
+    panic("kmem_cache_free");
+  s->free[s->nfree++] = ((char*)v - (char*)s - c->off) / c->size;
+  if(s->nfree == 1)
+    partialadd(c, s);
+  if(--s->inuse == 0 && (s->prev != 0 || s->next != 0)){
+    partialremove(c, s);
+    c->nslabs--;
+    kfree((char*)s);
+  }
+}
+
+// Allocate an object from c.
+// Returns 0 if the memory cannot be allocated.
+void*
+kmem_cache_alloc(struct kmem_cache *c)
+{
+  struct kmem_mag *m;
+  void *v;
+
+  pushcli();
+  m = &c->mag[cpu - cpus];
+  if(m->n > 0){
+    v = m->obj[--m->n];
+    popcli();
+    return v;
+  }
+  popcli();
+
+  acquire(&c->lock);
+  if(c->partial == 0 && !slabgrow(c)){
+    release(&c->lock);
+    return 0;
+  }
+  v = slabtake(c);
+  // Interrupts are off while c->lock is held, so this stays
+  // the magazine of the CPU we are running on.
+  m = &c->mag[cpu - cpus];
+  while(m->n < MAGSIZE/2 && c->partial)
+    m->obj[m->n++] = slabtake(c);
+  release(&c->lock);
+  return v;
+}
+
+// Free an object allocated from c.
+void
+kmem_cache_free(struct kmem_cache *c, void *v)
+{
+  struct kmem_mag *m;
+
+  pushcli();
+  m = &c->mag[cpu - cpus];
+  if(m->n == MAGSIZE){
+    acquire(&c->lock);
+    while(m->n > MAGSIZE/2)
+      slabput(c, m->obj[--m->n]);
+    release(&c->lock);
+  }
+  m->obj[m->n++] = v;
+  popcli();
+}
+
+void
+kmeminit(void)
+{
+  int i;
+
+  for(i = 0; i < NKMCACHE; i++)
+    kmem_cache_init(&kmcache[i], kmnames[i], KMMIN << i, 0);
+}
+
+// Allocate n bytes of kernel memory, at most PGSIZE/2.
+// Returns 0 if the memory cannot be allocated.
+void*
+kmalloc(uint n)
+{
+  int i;
+
+  for(i = 0; i < NKMCACHE; i++)
+    if(n <= KMMIN << i)
+      return kmem_cache_alloc(&kmcache[i]);
+  return 0;
+}
+
+// Free memory from kmalloc().
+void
+kmfree(void *v)
+{
+  struct slab *s;
+
+  s = (struct slab*)PGROUNDDOWN((uint)v);
+  kmem_cache_free(s->cache, v);
+}
@@ -0,0 +1,29 @@
+#ifndef XV6_SLAB_H_
+#define XV6_SLAB_H_
+
+#define MAGSIZE 16   // objects in a per-CPU magazine
+
+// A few objects a CPU keeps at hand so that most allocations
+// and frees take no lock.
+struct kmem_mag {
+  int n;
+  void *obj[MAGSIZE];
+};
+
+// Cache of equally sized kernel objects, carved out of pages
+// from kalloc().  Free objects are kept constructed: ctor runs
+// once when a slab page is set up, and kmem_cache_free()
+// expects the object back in the state ctor left it in.
+struct kmem_cache {
+  struct spinlock lock;
+  char *name;
+  uint size;              // Object size, rounded up
+  uint perslab;           // Objects in one slab page
+  uint off;               // Offset of the first object in a slab
+  void (*ctor)(void*);
+  struct slab *partial;   // Slabs with free objects
+  uint nslabs;            // Pages in use
+  struct kmem_mag mag[NCPU];
+};
+
+#endif /* XV6_SLAB_H_ */
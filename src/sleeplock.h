@@ -0,0 +1,16 @@
+#ifndef XV6_SLEEPLOCK_H_
+#define XV6_SLEEPLOCK_H_
+
+#include "spinlock.h"
+
+// Long-term locks for processes
+struct sleeplock {
+  uint locked;       // Is the lock held?
+  struct spinlock lk; // spinlock protecting this sleep lock
+
+  // For debugging:
+  char *name;        // Name of lock.
+  int pid;           // Process holding lock
+};
+
+#endif /* XV6_SLEEPLOCK_H_ */
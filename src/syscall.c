@@ -60,6 +60,8 @@ argptr(int n, char **pp, int size)
     return -1;
   if((uint)i >= proc->sz || (uint)i+size > proc->sz)
     return -1;
+  if(uvmtouch(i, size) < 0)
+    return -1;
   *pp = (char*)i;
   return 0;
 }
@@ -99,6 +101,10 @@ extern int sys_wait(void);
 extern int sys_write(void);
 extern int sys_uptime(void);
 extern int sys_mount(void);
+extern int sys_iostat(void);
+extern int sys_dmactl(void);
+extern int sys_fsync(void);
+extern int sys_sync(void);
 
 static int (*syscalls[])(void) = {
 [SYS_fork]    sys_fork,
@@ -122,7 +128,11 @@ static int (*syscalls[])(void) = {
 [SYS_link]    sys_link,
 [SYS_mkdir]   sys_mkdir,
 [SYS_close]   sys_close,
-[SYS_mount]   sys_mount
+[SYS_mount]   sys_mount,
+[SYS_iostat]  sys_iostat,
+[SYS_dmactl]  sys_dmactl,
+[SYS_fsync]   sys_fsync,
+[SYS_sync]    sys_sync,
 };
 
 void
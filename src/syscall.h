@@ -21,3 +21,7 @@
 #define SYS_mkdir  20
 #define SYS_close  21
 #define SYS_mount  22
+#define SYS_iostat 23
+#define SYS_dmactl 24
+#define SYS_fsync  25
+#define SYS_sync   26
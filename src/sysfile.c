@@ -13,6 +13,7 @@
 #include "file.h"
 #include "fcntl.h"
 #include "vfs.h"
+#include "iostat.h"
 
 // Fetch the nth word-sized system call argument as a file descriptor
 // and return both the descriptor and the corresponding struct file.
@@ -121,7 +122,7 @@ sys_link(void)
   if(argstr(0, &old) < 0 || argstr(1, &new) < 0)
     return -1;
 
-  begin_op();
+  begin_opn(DIROPBLOCKS);
   if((ip = namei(old)) == 0){
     end_op();
     return -1;
@@ -141,10 +142,14 @@ sys_link(void)
   if((dp = nameiparent(new, name)) == 0)
     goto bad;
   dp->iops->ilock(dp);
-  if(dp->dev != ip->dev || dp->iops->dirlink(dp, name, ip->inum, ip->type) < 0){
+  // "." and ".." always exist.  dirlink() would find dp itself
+  // through them and iput() it while dp is locked.
+  if(dp->fs_t->ops->namecmp(name, ".") == 0 || dp->fs_t->ops->namecmp(name, "..") == 0 ||
+     dp->dev != ip->dev || dp->iops->dirlink(dp, name, ip->inum, ip->type) < 0){
     iunlockput(dp);
     goto bad;
   }
+  denter(dp, name, ip->inum);
   iunlockput(dp);
   iput(ip);
 
@@ -197,6 +202,7 @@ sys_unlink(void)
 
   if(dp->iops->unlink(dp, off) == -1)
     panic("unlink: writei");
+  denter(dp, name, 0);
   if(ip->type == T_DIR){
     dp->nlink--;
     dp->iops->iupdate(dp);
@@ -254,8 +260,19 @@ create(char *path, short type, short major, short minor)
       panic("create dots");
   }
 
-  if(dp->iops->dirlink(dp, name, ip->inum, ip->type) < 0)
-    panic("create: dirlink");
+  if(dp->iops->dirlink(dp, name, ip->inum, ip->type) < 0){
+    // No room in dp: drop the new inode again.
+    if(type == T_DIR){
+      dp->nlink--;
+      dp->iops->iupdate(dp);
+    }
+    ip->nlink = 0;
+    ip->iops->iupdate(ip);
+    iunlockput(ip);
+    iunlockput(dp);
+    return 0;
+  }
+  denter(dp, name, ip->inum);
 
   iunlockput(dp);
 
@@ -329,6 +346,9 @@ sys_mount(void)
   }
 
   ip->type = T_MOUNT;
+  bcacheinfo(devi->minor);
+  bwbinit(devi->minor);
+  dpurge(devi->minor, 0);
 
   ip->iops->iunlock(ip);
   devi->iops->iunlock(devi);
@@ -347,7 +367,10 @@ sys_open(void)
   if(argstr(0, &path) < 0 || argint(1, &omode) < 0)
     return -1;
 
-  begin_op();
+  if(omode & O_CREATE)
+    begin_opn(DIROPBLOCKS);
+  else
+    begin_op();
 
   if(omode & O_CREATE){
     ip = create(path, T_FILE, 0, 0);
@@ -381,6 +404,9 @@ sys_open(void)
   f->type = FD_INODE;
   f->ip = ip;
   f->off = 0;
+  f->raoff = 0;
+  f->rawin = 0;
+  f->rablk = 0;
   f->readable = !(omode & O_WRONLY);
   f->writable = (omode & O_WRONLY) || (omode & O_RDWR);
   return fd;
@@ -392,7 +418,7 @@ sys_mkdir(void)
   char *path;
   struct inode *ip;
 
-  begin_op();
+  begin_opn(DIROPBLOCKS);
   if(argstr(0, &path) < 0 || (ip = create(path, T_DIR, 0, 0)) == 0){
     end_op();
     return -1;
@@ -410,7 +436,7 @@ sys_mknod(void)
   int len;
   int major, minor;
   
-  begin_op();
+  begin_opn(DIROPBLOCKS);
   if((len=argstr(0, &path)) < 0 ||
      argint(1, &major) < 0 ||
      argint(2, &minor) < 0 ||
@@ -496,3 +522,59 @@ sys_pipe(void)
   fd[1] = fd1;
   return 0;
 }
+
+// Wait until the updates made to fd's file system so
+// far are on disk.
+int
+sys_fsync(void)
+{
+  struct file *f;
+
+  if(argfd(0, 0, &f) < 0)
+    return -1;
+  if(f->type != FD_INODE)
+    return -1;
+  log_force(f->ip->dev);
+  bflush(f->ip->dev);
+  return 0;
+}
+
+// Write every file system's updates so far to disk.
+int
+sys_sync(void)
+{
+  int dev;
+
+  for(dev = 0; dev < NDEV; dev++){
+    log_force(dev);
+    bflush(dev);
+  }
+  return 0;
+}
+
+int
+sys_iostat(void)
+{
+  struct iostat *st;
+
+  if(argptr(0, (void*)&st, sizeof(*st)) < 0)
+    return -1;
+  bstat(st);
+  idestat(st);
+  dstat(st);
+  ext2stat(st);
+  kstat(st);
+  return 0;
+}
+
+// Turn IDE DMA on or off; returns the old setting,
+// or -1 if the disks cannot do DMA.
+int
+sys_dmactl(void)
+{
+  int on;
+
+  if(argint(0, &on) < 0)
+    return -1;
+  return idedma(on);
+}
@@ -36,6 +36,8 @@ idtinit(void)
 void
 trap(struct trapframe *tf)
 {
+  uint va;
+
   if(tf->trapno == T_SYSCALL){
     if(proc->killed)
       exit();
@@ -53,6 +55,8 @@ trap(struct trapframe *tf)
       ticks++;
       wakeup(&ticks);
       release(&tickslock);
+      logtimer();
+      bwbtimer();
     }
     lapiceoi();
     break;
@@ -80,6 +84,16 @@ trap(struct trapframe *tf)
     lapiceoi();
     break;
 
+  case T_PGFLT:
+    // Paging in may sleep; let interrupts in if the faulting
+    // code had them on, as a system call would.
+    va = rcr2();
+    if(tf->eflags & FL_IF)
+      sti();
+    if(pgfault(va, tf->err) == 0)
+      break;
+    // fall through
+
   //PAGEBREAK: 13
   default:
     if(proc == 0 || (tf->cs&3) == 0){
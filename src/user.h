@@ -1,5 +1,6 @@
 struct stat;
 struct rtcdate;
+struct iostat;
 
 // system calls
 int fork(void);
@@ -24,6 +25,10 @@ char* sbrk(int);
 int sleep(int);
 int uptime(void);
 int mount(char *dev, char *path, char *fstype);
+int iostat(struct iostat*);
+int dmactl(int);
+int fsync(int);
+int sync(void);
 
 // ulib.c
 int stat(char*, struct stat*);
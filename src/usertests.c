@@ -5,6 +5,7 @@
 #include "vfs.h"
 #include "s5.h"
 #include "fcntl.h"
+#include "iostat.h"
 #include "syscall.h"
 #include "traps.h"
 #include "memlayout.h"
@@ -136,6 +137,60 @@ opentest(void)
   printf(stdout, "open test ok\n");
 }
 
+void
+fsynctest(void)
+{
+  struct iostat st;
+  int fd, fds[2];
+
+  printf(stdout, "fsync test\n");
+  fd = open("fsyncfile", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf(stdout, "create fsyncfile failed\n");
+    exit();
+  }
+  if(write(fd, "aaaaaaaaaa", 10) != 10){
+    printf(stdout, "write fsyncfile failed\n");
+    exit();
+  }
+  if(fsync(fd) != 0){
+    printf(stdout, "fsync failed\n");
+    exit();
+  }
+  if(write(fd, "bbbbbbbbbb", 10) != 10){
+    printf(stdout, "write fsyncfile failed\n");
+    exit();
+  }
+  if(sync() != 0){
+    printf(stdout, "sync failed\n");
+    exit();
+  }
+  // Nothing else is writing, so sync() must have left no
+  // delayed write behind, not even one the writeback thread
+  // had under way or one held by the file system.
+  iostat(&st);
+  if(st.delwri != 0){
+    printf(stdout, "sync left %d delayed writes\n", st.delwri);
+    exit();
+  }
+  close(fd);
+  if(pipe(fds) != 0){
+    printf(stdout, "pipe() failed\n");
+    exit();
+  }
+  if(fsync(fds[0]) != -1){
+    printf(stdout, "fsync of a pipe succeeded!\n");
+    exit();
+  }
+  close(fds[0]);
+  close(fds[1]);
+  if(unlink("fsyncfile") < 0){
+    printf(stdout, "unlink fsyncfile failed\n");
+    exit();
+  }
+  printf(stdout, "fsync test ok\n");
+}
+
 void
 writetest(void)
 {
@@ -1590,6 +1645,68 @@ validatetest(void)
   printf(stdout, "validate ok\n");
 }
 
+// can a forked process still hand the kernel its stack
+// guard page?  (The kernel writes it through the user
+// pointer; it must not be shared copy-on-write.)
+void
+guardtest(void)
+{
+  int fds[2], pid;
+  char *guard;
+
+  printf(stdout, "guard test\n");
+  guard = (char*)(((uint)&pid & ~(4096-1)) - 4096);
+  if(pipe(fds) != 0){
+    printf(stdout, "pipe() failed\n");
+    exit();
+  }
+  close(fds[0]);
+  close(fds[1]);
+  pid = fork();
+  if(pid < 0){
+    printf(stdout, "fork failed\n");
+    exit();
+  }
+  // pipe() hands out the same two descriptors again.
+  if(pipe((int*)guard) != 0){
+    printf(stdout, "pipe() into the guard page failed\n");
+    exit();
+  }
+  close(fds[0]);
+  close(fds[1]);
+  if(pid == 0)
+    exit();
+  wait();
+  printf(stdout, "guard test ok\n");
+}
+
+// does shrinking the heap across a page table that was never
+// touched free the pages behind it, so that they come back
+// zeroed?
+void
+sbrkholetest(void)
+{
+  char *a, *base, *p;
+
+  printf(stdout, "sbrk hole test\n");
+  a = sbrk(0);
+  base = (char*)(((uint)a + (4<<20) - 1) & ~((4<<20) - 1));
+  if(sbrk(base + (12<<20) - a) != a){
+    printf(stdout, "sbrk hole test could not grow\n");
+    exit();
+  }
+  p = base + (8<<20);
+  *p = 99;
+  sbrk(base + (6<<20) - sbrk(0));
+  sbrk(base + (12<<20) - sbrk(0));
+  if(*p != 0){
+    printf(stdout, "sbrk hole test: page at %x was not freed\n", p);
+    exit();
+  }
+  sbrk(a - sbrk(0));
+  printf(stdout, "sbrk hole test ok\n");
+}
+
 // does unintialized data start out zero?
 char uninit[10000];
 void
@@ -1726,9 +1843,12 @@ main(int argc, char *argv[])
   bigargtest();
   bsstest();
   sbrktest();
+  sbrkholetest();
   validatetest();
+  guardtest();
 
   opentest();
+  fsynctest();
   writetest();
   writetest1();
   createtest();
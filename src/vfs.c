@@ -152,13 +152,10 @@ getfs(const char *fs_name)
 void
 generic_iunlock(struct inode *ip)
 {
-  if(ip == 0 || !(ip->flags & I_BUSY) || ip->ref < 1)
+  if(ip == 0 || !holdingsleep(&ip->lock) || ip->ref < 1)
     panic("iunlock");
 
-  acquire(&icache.lock);
-  ip->flags &= ~I_BUSY;
-  wakeup(ip);
-  release(&icache.lock);
+  releasesleep(&ip->lock);
 }
 
 void
@@ -203,7 +200,7 @@ generic_dirlink(struct inode *dp, char *name, uint inum, uint type)
 int
 generic_readi(struct inode *ip, char *dst, uint off, uint n)
 {
-  uint tot, m;
+  uint tot, m, addr;
   struct buf *bp;
 
   if(ip->type == T_DEV){
@@ -218,8 +215,13 @@ generic_readi(struct inode *ip, char *dst, uint off, uint n)
     n = ip->size - off;
 
   for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
-    bp = ip->fs_t->ops->bread(ip->dev, ip->iops->bmap(ip, off/sb[ip->dev].blocksize));
     m = min(n - tot, sb[ip->dev].blocksize - off % sb[ip->dev].blocksize);
+    // Holes read as zeros; reading must not allocate them.
+    if((addr = ip->iops->blookup(ip, off/sb[ip->dev].blocksize)) == 0){
+      memset(dst, 0, m);
+      continue;
+    }
+    bp = ip->fs_t->ops->bread(ip->dev, addr);
     memmove(dst, bp->data + off % sb[ip->dev].blocksize, m);
     ip->fs_t->ops->brelse(bp);
   }
@@ -252,24 +254,25 @@ generic_readi(struct inode *ip, char *dst, uint off, uint n)
 //   is non-zero. ialloc() allocates, iput() frees if
 //   the link count has fallen to zero.
 //
-// * Referencing in cache: an entry in the inode cache
-//   is free if ip->ref is zero. Otherwise ip->ref tracks
-//   the number of in-memory pointers to the entry (open
-//   files and current directories). iget() to find or
-//   create a cache entry and increment its ref, iput()
-//   to decrement ref.
+// * Referencing in cache: ip->ref tracks the number of
+//   in-memory pointers to the entry (open files and current
+//   directories). iget() to find or create a cache entry and
+//   increment its ref, iput() to decrement ref.  Entries are
+//   found through a hash table on (dev, inum).  An entry whose
+//   ref falls to zero stays cached, on an LRU list, and is
+//   recycled for another inode only when iget() runs out of
+//   unused entries, least recently used first.
 //
 // * Valid: the information (type, size, &c) in an inode
 //   cache entry is only correct when the I_VALID bit
 //   is set in ip->flags. ilock() reads the inode from
-//   the disk and sets I_VALID, while iput() clears
-//   I_VALID if ip->ref has fallen to zero.
+//   the disk and sets I_VALID.  An entry keeps I_VALID on
+//   the LRU list, so getting it again needs no disk read.
 //
 // * Locked: file system code may only examine and modify
 //   the information in an inode and its content if it
-//   has first locked the inode. The I_BUSY flag indicates
-//   that the inode is locked. ilock() sets I_BUSY,
-//   while iunlock clears it.
+//   has first locked the inode with ilock(), which takes
+//   the inode's sleep lock; iunlock() releases it.
 //
 // Thus a typical sequence is:
 //   ip = iget(dev, inum)
@@ -292,30 +295,86 @@ generic_readi(struct inode *ip, char *dst, uint off, uint n)
 void
 iinit(int dev)
 {
+  struct inode *ip;
+
   initlock(&icache.lock, "icache");
+  icache.lru.lprev = &icache.lru;
+  icache.lru.lnext = &icache.lru;
+  for(ip = &icache.inode[0]; ip < &icache.inode[NINODE]; ip++){
+    initsleeplock(&ip->lock, "inode");
+    ip->lnext = icache.lru.lnext;
+    ip->lprev = &icache.lru;
+    icache.lru.lnext->lprev = ip;
+    icache.lru.lnext = ip;
+  }
   rootfs->fs_t->ops->readsb(dev, &sb[dev]);
+  bcacheinfo(dev);
   /* cprintf("sb: size %d nblocks %d ninodes %d nlog %d logstart %d inodestart %d bmap start %d\n", sb[dev].size, */
   /*         sb[dev].nblocks, sb[dev].ninodes, sb[dev].nlog, sb[dev].logstart, sb[dev].inodestart, sb[dev].bmapstart); */
 }
 
-// Find the inode with number inum on device dev
-// and return the in-memory copy. Does not lock
-// the inode and does not read it from disk.
-struct inode*
-iget(uint dev, uint inum, int (*fill_inode)(struct inode *))
+static struct inode**
+ihash(uint dev, uint inum)
 {
-  struct inode *ip, *empty;
-  struct filesystem_type *fs_t;
+  return &icache.hash[(dev * 31 + inum) % NIHASH];
+}
 
-  acquire(&icache.lock);
+// Take ip off the LRU list.  Caller holds icache.lock.
+static void
+lruremove(struct inode *ip)
+{
+  ip->lprev->lnext = ip->lnext;
+  ip->lnext->lprev = ip->lprev;
+  ip->lprev = ip->lnext = 0;
+}
 
-  // Is the inode already cached?
-  empty = 0;
-  for(ip = &icache.inode[0]; ip < &icache.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
+// Take ip off its hash chain, if it is still on it.
+// Caller holds icache.lock.
+static void
+iunhash(struct inode *ip)
+{
+  struct inode **pp;
+
+  for(pp = ihash(ip->dev, ip->inum); *pp != 0; pp = &(*pp)->hnext){
+    if(*pp == ip){
+      *pp = ip->hnext;
+      break;
+    }
+  }
+  ip->hnext = 0;
+}
+
+// Take a cache entry for another inode: the least recently
+// used one that nobody refers to.  Caller holds icache.lock.
+static struct inode*
+irecycle(void)
+{
+  struct inode *ip;
+
+  ip = icache.lru.lprev;
+  if(ip == &icache.lru)
+    panic("iget: no inodes");
+  lruremove(ip);
+  if(ip->iops != 0){
+    iunhash(ip);
+    ip->iops->cleanup(ip);
+    ip->iops = 0;
+  }
+  return ip;
+}
+
+// Return the cached inode inum on dev with a new reference,
+// or 0 if it is not cached.  Caller holds icache.lock.
+static struct inode*
+ifind(uint dev, uint inum)
+{
+  struct inode *ip;
+
+  for(ip = *ihash(dev, inum); ip != 0; ip = ip->hnext){
+    if(ip->dev == dev && ip->inum == inum){
 
       // If the current inode is an mount point
-      if (ip->type == T_MOUNT) {
+      if (ip->type == T_MOUNT && ip->ref > 0) {
         struct inode *rinode = mtablertinode(ip);
 
         if (rinode == 0) {
@@ -323,38 +382,72 @@ iget(uint dev, uint inum, int (*fill_inode)(struct inode *))
         }
 
         rinode->ref++;
-
-        release(&icache.lock);
         return rinode;
       }
 
-      ip->ref++;
-      release(&icache.lock);
+      if(ip->ref++ == 0)
+        lruremove(ip);
       return ip;
     }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
+  }
+  return 0;
+}
+
+// Like iget(), but return 0 instead of setting up a cache
+// entry if the inode is not cached.
+struct inode*
+icached(uint dev, uint inum)
+{
+  struct inode *ip;
+
+  acquire(&icache.lock);
+  ip = ifind(dev, inum);
+  release(&icache.lock);
+  return ip;
+}
+
+// Find the inode with number inum on device dev
+// and return the in-memory copy. Does not lock
+// the inode and does not read it from disk.
+struct inode*
+iget(uint dev, uint inum, int (*fill_inode)(struct inode *))
+{
+  struct inode *ip;
+  struct filesystem_type *fs_t;
+
+  acquire(&icache.lock);
+
+  // Is the inode already cached?
+  if((ip = ifind(dev, inum)) != 0){
+    release(&icache.lock);
+    return ip;
   }
 
   // Recycle an inode cache entry.
-  if(empty == 0)
-    panic("iget: no inodes");
+  ip = irecycle();
 
   fs_t = getvfsentry(IDEMAJOR, dev)->fs_t;
 
-  ip = empty;
   ip->dev = dev;
   ip->inum = inum;
   ip->ref = 1;
   ip->flags = 0;
   ip->fs_t = fs_t;
   ip->iops = fs_t->iops;
-
+  ip->hnext = *ihash(dev, inum);
+  *ihash(dev, inum) = ip;
+
+  // Others can find ip from here on, but ilock() makes them
+  // wait until fill_inode has set up ip->i_private.  Nobody
+  // holds the lock of an unreferenced entry, so this does
+  // not sleep.
+  acquiresleep(&ip->lock);
   release(&icache.lock);
 
   if (!fill_inode(ip)) {
     panic("Error on fill inode");
   }
+  releasesleep(&ip->lock);
 
   return ip;
 }
@@ -380,25 +473,47 @@ idup(struct inode *ip)
 void
 iput(struct inode *ip)
 {
-  acquire(&icache.lock);
-  if(ip->ref == 1 && (ip->flags & I_VALID) && ip->nlink == 0){
-    // inode has no links and no other references: truncate and free.
-    if(ip->flags & I_BUSY)
-      panic("iput busy");
-    ip->flags |= I_BUSY;
-    release(&icache.lock);
-    ip->iops->itrunc(ip);
-    ip->type = 0;
-    ip->iops->iupdate(ip);
-    /* ip->iops->cleanup(ip); */
+  int r;
+
+  acquiresleep(&ip->lock);
+  if((ip->flags & I_VALID) && ip->nlink == 0){
     acquire(&icache.lock);
-    ip->flags = 0;
-    wakeup(ip);
+    r = ip->ref;
+    if(r == 1){
+      // Nobody else can reach ip.  Unhash it before its disk
+      // inode is freed, so that an iget() of the inode number
+      // once it is allocated again gets a fresh entry rather
+      // than this one half torn down.
+      iunhash(ip);
+    }
+    release(&icache.lock);
+    if(r == 1){
+      // inode has no links and no other references: truncate and free.
+      if(ip->type == T_DIR)
+        dpurge(ip->dev, ip->inum);
+      ip->iops->itrunc(ip);
+      ip->type = 0;
+      ip->iops->iupdate(ip);
+      ip->flags = 0;
+    }
   }
+  releasesleep(&ip->lock);
+
+  acquire(&icache.lock);
   ip->ref--;
 
-  if (ip->ref == 0 ) {
-    ip->iops->cleanup(ip);
+  if (ip->ref == 0) {
+    // Keep it cached.  A freed inode goes to the far end of
+    // the LRU list, to be recycled first.
+    if(ip->flags & I_VALID){
+      ip->lnext = icache.lru.lnext;
+      ip->lprev = &icache.lru;
+    } else {
+      ip->lnext = &icache.lru;
+      ip->lprev = icache.lru.lprev;
+    }
+    ip->lprev->lnext = ip;
+    ip->lnext->lprev = ip;
   }
 
   release(&icache.lock);
@@ -470,7 +585,8 @@ skipelem(char *path, char *name)
 static struct inode*
 namex(char *path, int nameiparent, char *name)
 {
-  struct inode *ip, *next, *ir;
+  struct inode *ip, *next;
+  uint inum;
 
   if(*path == '/')
     ip = rootfs->fs_t->ops->getroot(IDEMAJOR, ROOTDEV);
@@ -490,22 +606,36 @@ namex(char *path, int nameiparent, char *name)
     }
 
     component_search:
-    if((next = ip->iops->dirlookup(ip, name, 0)) == 0){
-      iunlockput(ip);
-      return 0;
-    }
-
-    ir = next->fs_t->ops->getroot(IDEMAJOR, next->dev);
-
-    if (next->inum == ir->inum  && isinoderoot(ip) && (strncmp(name, "..", 2) == 0)) {
+    // ".." of a mounted file system's root is in the
+    // directory it is mounted on.
+    if (strncmp(name, "..", DIRSIZ) == 0 && isinoderoot(ip)) {
       struct inode *mntinode = mtablemntinode(ip);
       iunlockput(ip);
-      ip = mntinode;
+      ip = idup(mntinode);
       ip->iops->ilock(ip);
-      ip->ref++;
       goto component_search;
     }
 
+    next = 0;
+    if(dlookup(ip, name, &inum)){
+      if(inum == 0){  // known not to be there
+        iunlockput(ip);
+        return 0;
+      }
+      next = icached(ip->dev, inum);
+    }
+    if(next == 0){
+      if((next = ip->iops->dirlookup(ip, name, 0)) == 0){
+        denter(ip, name, 0);
+        iunlockput(ip);
+        return 0;
+      }
+      // A mount point's root is on another device; leave
+      // those to dirlookup() and iget().
+      if(next->dev == ip->dev)
+        denter(ip, name, next->inum);
+    }
+
     iunlockput(ip);
 
     ip = next;
@@ -5,6 +5,7 @@
 #include "list.h"
 #include "stat.h"
 #include "spinlock.h"
+#include "sleeplock.h"
 
 #ifndef XV6_VFS_H_
 #define XV6_VFS_H_
@@ -35,6 +36,7 @@ struct inode_operations {
   void (*itrunc)(struct inode *ip);
   void (*cleanup)(struct inode *ip);
   uint (*bmap)(struct inode *ip, uint bn);
+  uint (*blookup)(struct inode *ip, uint bn);  // like bmap, 0 for a hole
   void (*ilock)(struct inode* ip);
   void (*iunlock)(struct inode* ip);
   void (*stati)(struct inode *ip, struct stat *st);
@@ -54,7 +56,11 @@ struct inode {
   uint dev;                     // Minor Device number
   uint inum;                    // Inode number
   int ref;                      // Reference count
-  int flags;                    // I_BUSY, I_VALID
+  struct sleeplock lock;        // protects everything below here
+  int flags;                    // I_VALID
+  struct inode *hnext;          // icache hash chain
+  struct inode *lprev;          // icache LRU list, while ref is 0
+  struct inode *lnext;
   struct filesystem_type *fs_t; // The Filesystem type this inode is stored in
   struct inode_operations *iops; // The specific inode operations
   void *i_private;               // File System specific informations
@@ -69,16 +75,20 @@ struct inode {
 #define INODE_FREE 0
 #define INODE_USED 1
 
-#define I_BUSY 0x1
 #define I_VALID 0x2
 
+#define NIHASH 1021  // icache hash buckets
+
 struct {
   struct spinlock lock;
   struct inode inode[NINODE];
+  struct inode *hash[NIHASH]; // cached inodes by (dev, inum)
+  struct inode lru;           // unreferenced inodes, least recent last
 } icache;
 
 // Inode main operations
 struct inode* iget(uint dev, uint inum, int (*fill_super)(struct inode *));
+struct inode* icached(uint dev, uint inum);
 
 // Directory is a file containing a sequence of dirent structures.
 #define DIRSIZ 14
@@ -260,7 +260,7 @@ deallocuvm(pde_t *pgdir, uint oldsz, uint newsz)
   for(; a  < oldsz; a += PGSIZE){
     pte = walkpgdir(pgdir, (char*)a, 0);
     if(!pte)
-      a += (NPTENTRIES - 1) * PGSIZE;
+      a = PGADDR(PDX(a) + 1, 0, 0) - PGSIZE;  // skip to the next page table
     else if((*pte & PTE_P) != 0){
       pa = PTE_ADDR(*pte);
       if(pa == 0)
@@ -306,7 +306,9 @@ clearpteu(pde_t *pgdir, char *uva)
 }
 
 // Given a parent process's page table, create a copy
-// of it for a child.
+// of it for a child.  The two share the user pages: writable
+// ones become read-only and copy-on-write in both, and the
+// first write to one gets its writer a copy (see cowcopy).
 pde_t*
 copyuvm(pde_t *pgdir, uint sz)
 {
@@ -318,18 +320,35 @@ copyuvm(pde_t *pgdir, uint sz)
   if((d = setupkvm()) == 0)
     return 0;
   for(i = 0; i < sz; i += PGSIZE){
-    if((pte = walkpgdir(pgdir, (void *) i, 0)) == 0)
-      panic("copyuvm: pte should exist");
-    if(!(*pte & PTE_P))
-      panic("copyuvm: page not present");
+    // Pages not loaded yet will be in the child too.
+    if((pte = walkpgdir(pgdir, (void *) i, 0)) == 0 || !(*pte & PTE_P))
+      continue;
     pa = PTE_ADDR(*pte);
     flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
-      goto bad;
-    memmove(mem, (char*)p2v(pa), PGSIZE);
-    if(mappages(d, (void*)i, PGSIZE, v2p(mem), flags) < 0)
+    if((*pte & (PTE_W|PTE_U)) == PTE_W){
+      // The stack guard page: the kernel may still write it
+      // through a user pointer, and cowcopy() only handles
+      // user pages, so the child gets its own copy.
+      if((mem = kalloc()) == 0)
+        goto bad;
+      memmove(mem, (char*)p2v(pa), PGSIZE);
+      if(mappages(d, (void*)i, PGSIZE, v2p(mem), flags) < 0){
+        kfree(mem);
+        goto bad;
+      }
+      continue;
+    }
+    if(*pte & PTE_W){
+      *pte = (*pte & ~PTE_W) | PTE_COW;
+      flags = PTE_FLAGS(*pte);
+    }
+    if(mappages(d, (void*)i, PGSIZE, pa, flags) < 0)
       goto bad;
+    kdup(p2v(pa));
   }
+  // The parent's pages went read-only.
+  if(pgdir == proc->pgdir)
+    lcr3(v2p(pgdir));
   return d;
 
 bad:
@@ -337,6 +356,114 @@ bad:
   return 0;
 }
 
+// Give pgdir a private, writable copy of the copy-on-write
+// page at va, or just make the page writable again if no
+// other page table shares it any more.
+// Returns 0 on success, -1 if va is not a copy-on-write page
+// or there is no memory for the copy.
+static int
+cowcopy(pde_t *pgdir, uint va)
+{
+  pte_t *pte;
+  char *mem, *v;
+
+  if((pte = walkpgdir(pgdir, (void*)va, 0)) == 0)
+    return -1;
+  if((*pte & (PTE_P|PTE_U|PTE_COW)) != (PTE_P|PTE_U|PTE_COW))
+    return -1;
+  v = p2v(PTE_ADDR(*pte));
+  if(krefs(v) > 1){
+    if((mem = kalloc()) == 0)
+      return -1;
+    memmove(mem, v, PGSIZE);
+    *pte = v2p(mem) | PTE_FLAGS(*pte);
+    kfree(v);
+  }
+  *pte = (*pte & ~PTE_COW) | PTE_W;
+  if(pgdir == proc->pgdir)
+    lcr3(v2p(pgdir));
+  return 0;
+}
+
+// Fill in the missing page at va in the current process:
+// from the program file if va lies in a segment exec left to
+// be paged in, with zeroes otherwise.  May sleep reading the
+// file.  Returns 0 on success, -1 if out of memory or the
+// file cannot be read.
+static int
+pgload(uint va)
+{
+  struct vmseg *s;
+  struct inode *ip;
+  char *mem;
+  uint n;
+  int r;
+
+  va = PGROUNDDOWN(va);
+  if((mem = kalloc()) == 0)
+    return -1;
+  memset(mem, 0, PGSIZE);
+  for(s = proc->seg; s < &proc->seg[proc->nseg]; s++){
+    if(va < s->va || va >= s->end)
+      continue;
+    if(va - s->va < s->filesz){
+      n = s->filesz - (va - s->va);
+      if(n > PGSIZE)
+        n = PGSIZE;
+      ip = proc->execip;
+      ip->iops->ilock(ip);
+      r = ip->iops->readi(ip, mem, s->off + (va - s->va), n);
+      ip->iops->iunlock(ip);
+      if(r != n){
+        kfree(mem);
+        return -1;
+      }
+    }
+    break;
+  }
+  if(mappages(proc->pgdir, (char*)va, PGSIZE, v2p(mem), PTE_W|PTE_U) < 0){
+    kfree(mem);
+    return -1;
+  }
+  return 0;
+}
+
+// Handle a page fault at va in the current process, from
+// user code or from the kernel touching user memory.
+// Returns 0 if the access can be retried, -1 if the fault
+// is the process's error.
+int
+pgfault(uint va, uint err)
+{
+  if(proc == 0 || va >= proc->sz)
+    return -1;
+  if((err & FEC_PR) == 0)
+    return pgload(va);
+  if(err & FEC_WR)
+    return cowcopy(proc->pgdir, va);
+  return -1;
+}
+
+// Load any missing pages of the current process from va to
+// va+n, so that the kernel can then use them while holding
+// locks, which a fault that reads the program file cannot.
+// Returns 0 on success, -1 if a page cannot be loaded.
+int
+uvmtouch(uint va, uint n)
+{
+  pte_t *pte;
+  uint a;
+
+  if(n == 0)
+    return 0;
+  for(a = PGROUNDDOWN(va); a < va + n; a += PGSIZE){
+    pte = walkpgdir(proc->pgdir, (char*)a, 0);
+    if((pte == 0 || (*pte & PTE_P) == 0) && pgload(a) < 0)
+      return -1;
+  }
+  return 0;
+}
+
 //PAGEBREAK!
 // Map user virtual address to kernel address.
 char*
@@ -360,10 +487,16 @@ copyout(pde_t *pgdir, uint va, void *p, uint len)
 {
   char *buf, *pa0;
   uint n, va0;
+  pte_t *pte;
 
   buf = (char*)p;
   while(len > 0){
     va0 = (uint)PGROUNDDOWN(va);
+    // Writing through the kernel mapping would bypass
+    // copy-on-write, so take a private copy first.
+    pte = walkpgdir(pgdir, (char*)va0, 0);
+    if(pte != 0 && (*pte & PTE_COW) && cowcopy(pgdir, va0) < 0)
+      return -1;
     pa0 = uva2ka(pgdir, (char*)va0);
     if(pa0 == 0)
       return -1;